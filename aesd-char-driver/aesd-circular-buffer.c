@@ -16,6 +16,20 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the number of valid entries in @param buffer
+ */
+static unsigned int aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    /*
+     * in_offs == out_offs means empty unless full; the mask turns a wrapped
+     * (in - out) into the right positive count
+     */
+    if (buffer->full)
+        return buffer->capacity;
+    return (buffer->in_offs - buffer->out_offs) & buffer->mask;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -31,59 +45,52 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 {
     /**
      * Pseudocode:
-     *   1. Handle empty buffer: if not full and in_offs == out_offs,
-     *      there are no entries — return NULL
+     *   1. Handle empty buffer or an offset past the end: char_offset must
+     *      be below total_size, otherwise return NULL
      *   2. Determine how many entries are in the buffer:
-     *        - If full: count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
-     *        - Else: count = (in_offs - out_offs) mod MAX (handles wrap)
-     *   3. Starting from out_offs (the oldest entry), iterate through
-     *      'count' entries:
-     *        - If char_offset < current entry's size, the target byte
-     *          lives in this entry. Set *entry_offset_byte_rtn to the
-     *          remaining char_offset and return a pointer to this entry.
-     *        - Otherwise, subtract the entry's size from char_offset
-     *          and move to the next entry (wrapping with modulo).
-     *   4. If no entry contains the offset, return NULL
+     *        - If full: count = capacity
+     *        - Else: count = (in_offs - out_offs) & mask (handles wrap)
+     *   3. Binary search the 'count' entries starting at out_offs for the
+     *      newest one whose start (entry_offs relative to the oldest
+     *      entry's) is not past char_offset
+     *   4. Set *entry_offset_byte_rtn to char_offset minus that start and
+     *      return the entry
      */
 
-    uint8_t num_entries;
-    uint8_t i;
-    uint8_t current;
+    unsigned int num_entries;
+    unsigned int lo, hi, mid;
+    unsigned int current;
+    size_t base;
 
-    /* Step 1: empty buffer check — both offsets equal and not marked full */
-    if (!buffer->full && (buffer->in_offs == buffer->out_offs)) {
+    /* Step 1: nothing stored at or beyond total_size (covers empty buffers) */
+    if (char_offset >= buffer->total_size) {
         return NULL;
     }
 
     /* Step 2: determine the number of valid entries */
-    if (buffer->full) {
-        num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else {
-        /*
-         * When in_offs > out_offs this is simply (in - out).
-         * When in_offs < out_offs (wrapped), adding MAX before modulo
-         * produces the correct positive count.
-         */
-        num_entries = (buffer->in_offs - buffer->out_offs
-                       + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-                      % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    num_entries = aesd_circular_buffer_count(buffer);
 
-    /* Step 3: walk entries from oldest (out_offs) to newest */
-    current = buffer->out_offs;
-    for (i = 0; i < num_entries; i++) {
-        if (char_offset < buffer->entry[current].size) {
-            /* Target byte is within this entry */
-            *entry_offset_byte_rtn = char_offset;
-            return &buffer->entry[current];
-        }
-        /* Subtract this entry's bytes and advance to the next slot */
-        char_offset -= buffer->entry[current].size;
-        current = (current + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    /*
+     * Step 3: entry 'lo' always starts at or before char_offset.  Empty
+     * entries share their start with the next one, and the search settles
+     * on the newest of those, which is the one holding the byte.
+     */
+    base = buffer->entry_offs[buffer->out_offs];
+    lo = 0;
+    hi = num_entries;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        current = (buffer->out_offs + mid) & buffer->mask;
+        if (buffer->entry_offs[current] - base <= char_offset)
+            lo = mid;
+        else
+            hi = mid;
     }
 
-    /* Step 4: offset is beyond all stored data */
-    return NULL;
+    /* Step 4: offset within the entry found */
+    current = (buffer->out_offs + lo) & buffer->mask;
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_offs[current] - base);
+    return &buffer->entry[current];
 }
 
 /**
@@ -97,91 +104,155 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 {
     /**
      * Pseudocode:
-     *   1. Write the new entry into the slot at in_offs (shallow copy of
-     *      buffptr pointer and size — caller owns the underlying memory)
+     *   1. Record where the new entry starts: right after the newest entry
+     *      (or anywhere, for an empty buffer)
      *   2. If buffer was already full before this write, the oldest entry
-     *      at out_offs was just overwritten, so advance out_offs by one
-     *      (wrapping around with modulo)
-     *   3. Advance in_offs to the next slot (wrapping around with modulo)
-     *   4. If in_offs now equals out_offs, the buffer has become full
+     *      at out_offs is evicted: drop its size from total_size
+     *   3. Write the new entry into the slot at in_offs (shallow copy of
+     *      buffptr pointer and size — caller owns the underlying memory)
+     *      and add its size to total_size
+     *   4. If the buffer was full, clear the evicted slot unless the new
+     *      entry just overwrote it (there are more slots than capacity),
+     *      then advance out_offs by one (wrapping around with the mask)
+     *   5. Advance in_offs to the next slot (wrapping around with the mask)
+     *   6. If capacity entries are now held, the buffer has become full
      */
 
-    /* Step 1: copy the entry into the current write slot */
+    unsigned int newest;
+    unsigned int count;
+    size_t start = 0;
+
+    /* Step 1: the new entry starts where the newest one ends */
+    if (buffer->full || buffer->in_offs != buffer->out_offs) {
+        newest = (buffer->in_offs - 1) & buffer->mask;
+        start = buffer->entry_offs[newest] + buffer->entry[newest].size;
+    }
+
+    /* Step 2: if full, the oldest entry's bytes leave the buffer */
+    if (buffer->full) {
+        buffer->total_size -= buffer->entry[buffer->out_offs].size;
+    }
+
+    /* Step 3: copy the entry into the current write slot */
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_offs[buffer->in_offs] = start;
+    buffer->total_size += add_entry->size;
 
-    /* Step 2: if full, oldest entry was overwritten — advance the read pointer */
+    /* Step 4: if full, oldest entry was evicted — advance the read pointer */
     if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (buffer->out_offs != buffer->in_offs) {
+            buffer->entry[buffer->out_offs].buffptr = NULL;
+            buffer->entry[buffer->out_offs].size = 0;
+        }
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
     }
 
-    /* Step 3: advance the write pointer to the next slot */
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    /* Step 5: advance the write pointer to the next slot */
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
 
-    /* Step 4: detect whether the buffer is now full (write caught up to read) */
-    buffer->full = (buffer->in_offs == buffer->out_offs);
+    /*
+     * Step 6: detect whether the buffer is now full.  A count of 0 after an
+     * add means the write pointer caught up to the read pointer, which only
+     * happens when capacity fills every slot.
+     */
+    count = (buffer->in_offs - buffer->out_offs) & buffer->mask;
+    buffer->full = (count == 0 || count == buffer->capacity);
 }
 
 /**
-* Computes the total number of bytes stored across all valid entries in the
-* circular buffer.  Any necessary locking must be performed by the caller.
-* @param buffer the buffer to compute the total size of
-* @return the sum of all entry sizes, or 0 if the buffer is empty
+* Removes the oldest entry from @param buffer, for callers that evict by
+* something other than entry count.  Any necessary locking must be handled by
+* the caller, who also owns the memory the removed entry references.
+* @param entry_rtn receives the removed entry, and is left alone if the
+*      buffer is empty
+* @return true if an entry was removed, false if the buffer was empty
 */
-size_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer)
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry_rtn)
 {
     /**
      * Pseudocode:
-     *   1. Determine how many entries are valid (same logic as find_entry):
-     *        - If buffer is empty (not full and in_offs == out_offs), return 0
-     *        - If full: count = MAX (10)
-     *        - Else: count = (in_offs - out_offs + MAX) % MAX
-     *   2. Walk from out_offs through 'count' entries, accumulating each
-     *      entry's size into a running total
-     *   3. Return the total
+     *   1. Nothing to remove from an empty buffer
+     *   2. Hand the entry at out_offs back to the caller, drop its size
+     *      from total_size and clear its slot
+     *   3. Advance out_offs by one (wrapping around with the mask); the
+     *      buffer now has a free slot, so it is no longer full
      */
 
-    size_t total = 0;
-    uint8_t num_entries;
-    uint8_t i;
-    uint8_t current;
-
-    /* Step 1: empty buffer returns 0 */
-    if (!buffer->full && (buffer->in_offs == buffer->out_offs))
-        return 0;
+    struct aesd_buffer_entry *oldest;
 
-    /* Determine valid entry count */
-    if (buffer->full) {
-        num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else {
-        num_entries = (buffer->in_offs - buffer->out_offs
-                       + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-                      % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    /* Step 1: empty buffer */
+    if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+        return false;
     }
 
-    /* Step 2: sum all entry sizes */
-    current = buffer->out_offs;
-    for (i = 0; i < num_entries; i++) {
-        total += buffer->entry[current].size;
-        current = (current + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    /* Step 2: the oldest entry leaves the buffer */
+    oldest = &buffer->entry[buffer->out_offs];
+    *entry_rtn = *oldest;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
 
-    /* Step 3: return accumulated total */
-    return total;
+    /* Step 3: advance the read pointer */
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->full = false;
+    return true;
+}
+
+/**
+* Returns the total number of bytes stored across all valid entries in the
+* circular buffer, which add_entry keeps up to date.  Any necessary locking
+* must be performed by the caller.
+* @param buffer the buffer to return the total size of
+* @return the sum of all entry sizes, or 0 if the buffer is empty
+*/
+size_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     /**
      * Pseudocode:
-     *   Zero out the entire buffer struct so that:
+     *   1. Zero out the entire buffer struct so that:
      *     - All entry[].buffptr pointers become NULL
      *     - All entry[].size values become 0
      *     - in_offs = 0  (next write goes to slot 0)
      *     - out_offs = 0 (next read comes from slot 0)
      *     - full = false (buffer starts empty)
+     *     - total_size = 0 and every entry_offs[] = 0
+     *   2. Point entry and entry_offs at the storage inside the struct and
+     *      set the default capacity
      */
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->entry_offs = buffer->default_entry_offs;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->mask = AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS - 1;
+}
+
+/**
+* Initializes @param buffer to an empty struct holding up to @param capacity
+* entries in caller-provided storage.  @param entries and @param entry_offs
+* must each have aesd_circular_buffer_slots(capacity) elements and outlive
+* the buffer; their contents need not be initialized.  @param capacity must
+* be at least 1 and at most AESD_CIRCULAR_BUFFER_MAX_SLOTS.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            unsigned int capacity, struct aesd_buffer_entry *entries, size_t *entry_offs)
+{
+    unsigned int slots = aesd_circular_buffer_slots(capacity);
+
+    memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    memset(entries, 0, slots * sizeof(*entries));
+    memset(entry_offs, 0, slots * sizeof(*entry_offs));
+    buffer->entry = entries;
+    buffer->entry_offs = entry_offs;
+    buffer->capacity = capacity;
+    buffer->mask = slots - 1;
 }
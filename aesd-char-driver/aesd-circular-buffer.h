@@ -16,7 +16,25 @@
 #include <stdbool.h>
 #endif
 
+/*
+ * Entries kept by aesd_circular_buffer_init().  Userspace builds may override
+ * it (-DAESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED=n); the driver can also pick
+ * another capacity at load time with aesd_circular_buffer_init_storage().
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+/*
+ * Entries live in a power-of-two number of slots, at least the capacity, so
+ * an index wraps with a mask instead of a division.  AESD_POW2_CEIL is the
+ * compile-time form of aesd_circular_buffer_slots(), for 32-bit values.
+ */
+#define AESD_OR_SHIFT_(x, s) ((x) | ((x) >> (s)))
+#define AESD_POW2_CEIL(n) \
+    (AESD_OR_SHIFT_(AESD_OR_SHIFT_(AESD_OR_SHIFT_(AESD_OR_SHIFT_(AESD_OR_SHIFT_( \
+        (n) - 1, 1), 2), 4), 8), 16) + 1)
+#define AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS AESD_POW2_CEIL(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
 
 struct aesd_buffer_entry
 {
@@ -30,44 +48,109 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/*
+ * entry and entry_offs point either at caller storage or, after
+ * aesd_circular_buffer_init(), at default_entry and default_entry_offs inside
+ * the struct itself.  So a buffer must be initialized with one of the init
+ * functions before any other use (zeroing it is not enough), and must not be
+ * copied by assignment or memcpy(): the copy would keep pointing at the
+ * original's storage.  Pass it by pointer instead.
+ */
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * mask + 1 slots long
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    unsigned int in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    unsigned int out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * The most entries the buffer holds before the oldest is overwritten
+     */
+    unsigned int capacity;
+    /**
+     * Number of slots minus one; slots is a power of two
+     */
+    unsigned int mask;
+    /**
+     * Running position of each slot's first byte in the stream of every byte
+     * ever added.  Only differences are meaningful: entry_offs[i] -
+     * entry_offs[out_offs] is where slot i starts in the concatenated
+     * contents, and increases from out_offs to the newest entry, so it can
+     * be binary searched.  Unsigned wraparound cancels out in the difference.
+     */
+    size_t *entry_offs;
+    /**
+     * Sum of the sizes of all valid entries, kept up to date by add_entry
+     */
+    size_t total_size;
+    /**
+     * Storage used by aesd_circular_buffer_init()
+     */
+    struct aesd_buffer_entry default_entry[AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS];
+    size_t default_entry_offs[AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS];
 };
 
+/*
+ * The largest power of two an unsigned int holds, and so the most slots a
+ * buffer can have; rounding any larger capacity up would overflow to 0
+ */
+#define AESD_CIRCULAR_BUFFER_MAX_SLOTS (~0u / 2 + 1)
+
+/**
+ * @return the number of slots, and so of entry and entry_offs elements, that
+ * aesd_circular_buffer_init_storage() needs for @param capacity entries, or
+ * 0 if @param capacity is above AESD_CIRCULAR_BUFFER_MAX_SLOTS
+ */
+static inline unsigned int aesd_circular_buffer_slots(unsigned int capacity)
+{
+    unsigned int slots = 1;
+
+    if (capacity > AESD_CIRCULAR_BUFFER_MAX_SLOTS)
+        return 0;
+    while (slots < capacity)
+        slots <<= 1;
+    return slots;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entry_rtn);
+
 extern size_t aesd_circular_buffer_total_size(struct aesd_circular_buffer *buffer);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            unsigned int capacity, struct aesd_buffer_entry *entries, size_t *entry_offs);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Useful when you've allocated memory for circular buffer entries and need to free it.
+ * It visits every slot, mask + 1 of them, which is more than the capacity
+ * unless that is a power of two (16 for the default of 10); slots holding no
+ * entry have a NULL buffptr and a size of 0.
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is an unsigned int stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * unsigned int index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -76,7 +159,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
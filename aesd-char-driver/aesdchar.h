@@ -25,12 +25,33 @@
 
 #include "aesd-circular-buffer.h"
 
+/*
+ * Lock statistics for dev->lock, gathered while the lockstat module
+ * parameter is set and shown in debugfs at aesdchar/lockstat.  Bucket 0
+ * counts waits or holds under 2us and bucket i those in [2^i, 2^(i+1)) us.
+ * Every field is updated with dev->lock held.
+ */
+#define AESD_LOCKSTAT_BUCKETS 24
+
+struct aesd_lockstat
+{
+    u64 wait[AESD_LOCKSTAT_BUCKETS];     /* Time from lock request to acquisition */
+    u64 hold[AESD_LOCKSTAT_BUCKETS];     /* Time from acquisition to release */
+    u64 locked_at;                       /* ktime of the current acquisition, 0 if untimed */
+};
+
 struct aesd_dev
 {
     struct aesd_circular_buffer buffer;  /* Circular buffer for write commands */
+    struct aesd_buffer_entry *entries;   /* buffer's slots when max_entries is not the default */
+    size_t *entry_offs;                  /* and their offsets, or NULL */
     struct mutex lock;                   /* Mutex protecting buffer and partial write state */
     char *partial_buf;                   /* Accumulates bytes until newline */
     size_t partial_len;                  /* Current length of partial_buf */
+    char *arena;                         /* Holds every entry's bytes when arena_size is set */
+    size_t arena_size;                   /* Bytes in arena */
+    size_t arena_head;                   /* Where in arena the newest entry ends */
+    struct aesd_lockstat lockstat;       /* Contention on lock, see aesd_lock() */
     struct cdev cdev;                    /* Char device structure */
 };
 
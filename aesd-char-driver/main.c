@@ -18,8 +18,15 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // kmalloc, kfree
+#include <linux/mm.h> // kvmalloc_array, kvfree
+#include <linux/vmalloc.h> // vmalloc, vfree
 #include <linux/uaccess.h> // copy_to_user, copy_from_user
 #include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "aesdchar.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -27,7 +34,101 @@ int aesd_minor =   0;
 MODULE_AUTHOR("jsnapoli1");
 MODULE_LICENSE("Dual BSD/GPL");
 
+static bool lockstat;
+module_param(lockstat, bool, 0644);
+MODULE_PARM_DESC(lockstat, "Record wait and hold time histograms for the device mutex");
+
+/* Upper bound on max_entries, so the slot arrays stay a sane size */
+#define AESD_MAX_ENTRIES_LIMIT (1U << 20)
+
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Commands kept in the history (default 10)");
+
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_bytes, "Bytes of commands kept in the history, 0 for no limit (default 0)");
+
+static unsigned long arena_size;
+module_param(arena_size, ulong, 0444);
+MODULE_PARM_DESC(arena_size, "Store commands in one preallocated arena of this many bytes "
+                 "instead of allocating each one, 0 to disable (default 0)");
+
 struct aesd_dev aesd_device;
+static struct dentry *aesd_debugfs_dir;
+
+static void aesd_lockstat_record(u64 *hist, u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    unsigned int bucket = us < 2 ? 0 : fls64(us) - 1;
+
+    if (bucket >= AESD_LOCKSTAT_BUCKETS)
+        bucket = AESD_LOCKSTAT_BUCKETS - 1;
+    hist[bucket]++;
+}
+
+/*
+ * Take dev->lock like mutex_lock_interruptible(), timing the wait and
+ * starting the hold timer when lockstat is enabled
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+
+    if (!READ_ONCE(lockstat))
+        return mutex_lock_interruptible(&dev->lock);
+
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    dev->lockstat.locked_at = ktime_get_ns();
+    aesd_lockstat_record(dev->lockstat.wait, dev->lockstat.locked_at - start);
+    return 0;
+}
+
+static void aesd_unlock(struct aesd_dev *dev)
+{
+    /* locked_at rather than lockstat decides, in case it was toggled meanwhile */
+    if (dev->lockstat.locked_at) {
+        aesd_lockstat_record(dev->lockstat.hold,
+                             ktime_get_ns() - dev->lockstat.locked_at);
+        dev->lockstat.locked_at = 0;
+    }
+    mutex_unlock(&dev->lock);
+}
+
+static void aesd_lockstat_show_hist(struct seq_file *s, const char *name, const u64 *hist)
+{
+    int i;
+
+    for (i = 0; i < AESD_LOCKSTAT_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+        if (i == AESD_LOCKSTAT_BUCKETS - 1)
+            seq_printf(s, "%s_us_ge_%llu %llu\n", name, 1ULL << i, hist[i]);
+        else
+            seq_printf(s, "%s_us_lt_%llu %llu\n", name, 2ULL << i, hist[i]);
+    }
+}
+
+/* debugfs aesdchar/lockstat, in the same format as the aesdsocket -s report */
+static int aesd_lockstat_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_lockstat snap;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    memcpy(&snap, &dev->lockstat, sizeof(snap));
+    mutex_unlock(&dev->lock);
+
+    seq_printf(s, "enabled %d\n", READ_ONCE(lockstat));
+    aesd_lockstat_show_hist(s, "wait", snap.wait);
+    aesd_lockstat_show_hist(s, "hold", snap.hold);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_lockstat);
 
 /* Store aesd_dev pointer in filp->private_data for read/write access */
 int aesd_open(struct inode *inode, struct file *filp)
@@ -46,7 +147,52 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-/* Read from the circular buffer at the current f_pos offset */
+/*
+ * Make room for a @len byte command in the arena, evicting the oldest entries
+ * until it fits, and return where it goes.  Entries are laid out in the
+ * arena in the order they were added and each one is contiguous, so one that
+ * does not fit before the end starts over at the beginning, and the tail it
+ * skipped is reused once the entries before it are evicted.  Caller holds
+ * dev->lock and has checked that @len is no larger than the arena.
+ */
+static char *aesd_arena_reserve(struct aesd_dev *dev, size_t len)
+{
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_buffer_entry evicted;
+    size_t tail;
+
+    for (;;) {
+        /* Commands are never empty, so no bytes means no entries */
+        if (aesd_circular_buffer_total_size(buffer) == 0) {
+            dev->arena_head = 0;
+            break;
+        }
+
+        tail = buffer->entry[buffer->out_offs].buffptr - dev->arena;
+        if (dev->arena_head > tail) {
+            /* Entries fill [tail, head): room after head, or before tail */
+            if (dev->arena_head + len <= dev->arena_size)
+                break;
+            if (len <= tail) {
+                dev->arena_head = 0;
+                break;
+            }
+        } else if (dev->arena_head + len <= tail) {
+            /* Entries have wrapped: the room is [head, tail) */
+            break;
+        }
+
+        aesd_circular_buffer_remove_oldest(buffer, &evicted);
+    }
+    return dev->arena + dev->arena_head;
+}
+
+/*
+ * Read from the circular buffer at the current f_pos offset, continuing
+ * across consecutive entries until @count bytes are copied or the history
+ * ends, so a full replay takes one read per buffer's worth rather than one
+ * per entry
+ */
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -55,33 +201,41 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     size_t entry_offset;
     size_t bytes_available;
     size_t bytes_to_copy;
+    size_t not_copied;
+    size_t copied = 0;
     ssize_t retval = 0;
 
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer,
-                *f_pos, &entry_offset);
-    if (!entry) {
-        /* No data at this offset — EOF */
-        goto out;
-    }
-
-    bytes_available = entry->size - entry_offset;
-    bytes_to_copy = (count < bytes_available) ? count : bytes_available;
+    while (copied < count) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer,
+                    *f_pos, &entry_offset);
+        if (!entry) {
+            /* No data at this offset — EOF */
+            break;
+        }
 
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_copy)) {
-        retval = -EFAULT;
-        goto out;
+        bytes_available = entry->size - entry_offset;
+        bytes_to_copy = min_t(size_t, count - copied, bytes_available);
+
+        /* A fault after some bytes were copied returns what was copied */
+        not_copied = copy_to_user(buf + copied, entry->buffptr + entry_offset,
+                                  bytes_to_copy);
+        *f_pos += bytes_to_copy - not_copied;
+        copied += bytes_to_copy - not_copied;
+        if (not_copied) {
+            if (!copied)
+                retval = -EFAULT;
+            break;
+        }
     }
+    if (copied)
+        retval = copied;
 
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
-
-out:
-    mutex_unlock(&dev->lock);
+    aesd_unlock(dev);
     return retval;
 }
 
@@ -91,13 +245,29 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 {
     struct aesd_dev *dev = filp->private_data;
     char *new_buf;
+    unsigned long budget;
     ssize_t retval = -ENOMEM;
 
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
 
+    /*
+     * A command larger than the whole byte budget could never be kept:
+     * drop it, so the next write starts a new command
+     */
+    budget = READ_ONCE(max_bytes);
+    if (dev->arena && (!budget || budget > dev->arena_size))
+        budget = dev->arena_size;
+    if (budget && (count > budget || dev->partial_len > budget - count)) {
+        kfree(dev->partial_buf);
+        dev->partial_buf = NULL;
+        dev->partial_len = 0;
+        retval = -EFBIG;
+        goto out;
+    }
+
     /* Grow the partial buffer to hold the incoming data */
     new_buf = krealloc(dev->partial_buf, dev->partial_len + count, GFP_KERNEL);
     if (!new_buf)
@@ -113,26 +283,48 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     /* Check if the partial buffer contains a newline — if so, commit it */
     if (dev->partial_len > 0 && dev->partial_buf[dev->partial_len - 1] == '\n') {
         struct aesd_buffer_entry new_entry;
+        struct aesd_buffer_entry evicted;
 
         new_entry.buffptr = dev->partial_buf;
         new_entry.size = dev->partial_len;
 
-        /* If buffer is full, free the entry that will be evicted */
-        if (dev->buffer.full) {
-            kfree(dev->buffer.entry[dev->buffer.in_offs].buffptr);
+        /* Evict oldest entries until the new one fits in the byte budget */
+        while (budget && dev->buffer.total_size + new_entry.size > budget &&
+               aesd_circular_buffer_remove_oldest(&dev->buffer, &evicted)) {
+            if (!dev->arena)
+                kfree(evicted.buffptr);
         }
 
-        aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
-
-        /* Ownership transferred to circular buffer; reset partial state */
-        dev->partial_buf = NULL;
-        dev->partial_len = 0;
+        if (dev->arena) {
+            /*
+             * Copy the command into the arena and keep partial_buf for the
+             * next one; evicted entries need no freeing
+             */
+            char *dest = aesd_arena_reserve(dev, new_entry.size);
+
+            memcpy(dest, dev->partial_buf, new_entry.size);
+            dev->arena_head += new_entry.size;
+            new_entry.buffptr = dest;
+            aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+            dev->partial_len = 0;
+        } else {
+            /* If buffer is full, free the entry that will be evicted */
+            if (dev->buffer.full) {
+                kfree(dev->buffer.entry[dev->buffer.out_offs].buffptr);
+            }
+
+            aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+
+            /* Ownership transferred to circular buffer; reset partial state */
+            dev->partial_buf = NULL;
+            dev->partial_len = 0;
+        }
     }
 
     retval = count;
 
 out:
-    mutex_unlock(&dev->lock);
+    aesd_unlock(dev);
     return retval;
 }
 
@@ -147,11 +339,11 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 
     /**
      * Pseudocode:
-     *   1. Acquire the device mutex — we read buffer entry sizes, so we
-     *      must prevent concurrent writes from adding or evicting entries
-     *      while we compute the total size
-     *   2. Compute the total size of all data in the circular buffer by
-     *      summing every valid entry's size; this acts as the logical
+     *   1. Acquire the device mutex — we read the buffer's total size, so
+     *      we must prevent concurrent writes from adding or evicting entries
+     *      while we use it
+     *   2. Read the total size of all data in the circular buffer, which
+     *      the buffer keeps as a running total; this acts as the logical
      *      "file size" for seek purposes
      *   3. Use fixed_size_llseek to handle the three whence modes:
      *        - SEEK_SET: new_pos = offset
@@ -162,10 +354,10 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
      */
 
     /* Step 1: lock the device to get a consistent view of the buffer */
-    if (mutex_lock_interruptible(&dev->lock))
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
 
-    /* Step 2: compute logical file size from circular buffer contents */
+    /* Step 2: logical file size, maintained by the circular buffer */
     total_size = aesd_circular_buffer_total_size(&dev->buffer);
 
     /*
@@ -186,7 +378,7 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
     new_pos = fixed_size_llseek(filp, offset, whence, total_size);
 
     /* Step 4: release the device mutex */
-    mutex_unlock(&dev->lock);
+    aesd_unlock(dev);
 
     return new_pos;
 }
@@ -227,35 +419,91 @@ int aesd_init_module(void)
     }
     memset(&aesd_device, 0, sizeof(struct aesd_dev));
 
+    if (max_entries == 0 || max_entries > AESD_MAX_ENTRIES_LIMIT) {
+        printk(KERN_WARNING "aesdchar: max_entries must be 1 to %u\n",
+               AESD_MAX_ENTRIES_LIMIT);
+        result = -EINVAL;
+        goto fail_region;
+    }
+
     /* Initialize circular buffer, mutex, and partial write state */
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    if (max_entries == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        aesd_circular_buffer_init(&aesd_device.buffer);
+    } else {
+        unsigned int slots = aesd_circular_buffer_slots(max_entries);
+
+        if (slots == 0) {
+            result = -EINVAL;
+            goto fail_storage;
+        }
+        aesd_device.entries = kvmalloc_array(slots, sizeof(*aesd_device.entries), GFP_KERNEL);
+        aesd_device.entry_offs = kvmalloc_array(slots, sizeof(*aesd_device.entry_offs),
+                                                GFP_KERNEL);
+        if (!aesd_device.entries || !aesd_device.entry_offs) {
+            result = -ENOMEM;
+            goto fail_storage;
+        }
+        aesd_circular_buffer_init_storage(&aesd_device.buffer, max_entries,
+                                          aesd_device.entries, aesd_device.entry_offs);
+    }
     mutex_init(&aesd_device.lock);
 
+    /* Command payloads, if they are kept in an arena */
+    if (arena_size) {
+        aesd_device.arena = vmalloc(arena_size);
+        if (!aesd_device.arena) {
+            result = -ENOMEM;
+            goto fail_storage;
+        }
+        aesd_device.arena_size = arena_size;
+    }
+
     result = aesd_setup_cdev(&aesd_device);
 
-    if (result) {
-        unregister_chrdev_region(dev, 1);
-    }
+    if (result)
+        goto fail_storage;
+
+    /* Statistics are optional; debugfs errors are not fatal */
+    aesd_debugfs_dir = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("lockstat", 0444, aesd_debugfs_dir, &aesd_device,
+                        &aesd_lockstat_fops);
+    return result;
+
+fail_storage:
+    vfree(aesd_device.arena);
+    kvfree(aesd_device.entries);
+    kvfree(aesd_device.entry_offs);
+fail_region:
+    unregister_chrdev_region(dev, 1);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
+    unsigned int index;
     struct aesd_buffer_entry *entry;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
+    debugfs_remove_recursive(aesd_debugfs_dir);
     cdev_del(&aesd_device.cdev);
 
-    /* Free all entries in the circular buffer */
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr)
-            kfree(entry->buffptr);
+    /* Free all entries in the circular buffer, or the arena holding them */
+    if (aesd_device.arena) {
+        vfree(aesd_device.arena);
+    } else {
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
+            if (entry->buffptr)
+                kfree(entry->buffptr);
+        }
     }
 
     /* Free any pending partial write */
     kfree(aesd_device.partial_buf);
 
+    /* Slot arrays, if max_entries needed more than the built-in ones */
+    kvfree(aesd_device.entries);
+    kvfree(aesd_device.entry_offs);
+
     unregister_chrdev_region(devno, 1);
 }
 
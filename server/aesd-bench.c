@@ -0,0 +1,339 @@
+/**
+ * aesd-bench.c - Load generator and latency benchmark for aesdsocket.
+ *
+ * Opens N concurrent connections, sends newline-terminated lines on each
+ * and times every write-then-replay round trip: from the first byte of a
+ * line being sent until that line has come back in the server's replay.
+ * Every line carries its connection and sequence number, so it can only
+ * appear in the stream after it was sent, which is how the end of the round
+ * trip is recognized without knowing how long the history is.
+ *
+ * Usage: aesd-bench [-H host] [-p port] [-U path] [-c conns] [-n lines] [-s size]
+ *                   [-r rate]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define RECV_SIZE 65536
+
+static const char *host = "127.0.0.1";
+static const char *port = "9000";
+static const char *unix_path = NULL;    /* connect to a local socket instead */
+static long conn_count = 16;
+static long lines_per_conn = 100;
+static long line_size = 64;
+static long rate = 0;           /* lines per second per connection, 0 = closed loop */
+
+static pthread_barrier_t start_barrier;
+
+struct client {
+    pthread_t tid;
+    int id;
+    int fd;
+    long completed;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long *latency_ns;
+    bool failed;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_local(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", unix_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, unix_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "connect %s: %s\n", unix_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_server(void)
+{
+    if (unix_path)
+        return connect_local();
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res, *ai;
+    int fd = -1;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo %s:%s: %s\n", host, port, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        fprintf(stderr, "connect %s:%s: %s\n", host, port, strerror(errno));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Fill line with a unique, newline-terminated payload of line_size bytes */
+static void format_line(char *line, int id, long seq)
+{
+    int n = snprintf(line, line_size, "c%d:%ld:", id, seq);
+    if (n > line_size - 1)
+        n = line_size - 1;
+    memset(line + n, 'x', line_size - 1 - n);
+    line[line_size - 1] = '\n';
+}
+
+/*
+ * Receive until line shows up in the stream.  carry holds the last
+ * line_size - 1 bytes seen, so a line split across reads is still found.
+ */
+static int await_line(struct client *c, const char *line, char *buf, size_t *carry)
+{
+    for (;;) {
+        ssize_t n = recv(c->fd, buf + *carry, RECV_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        c->bytes_received += n;
+
+        size_t have = *carry + n;
+        char *hit = memmem(buf, have, line, line_size);
+        if (hit) {
+            /* Whatever follows belongs to the rest of this replay */
+            *carry = 0;
+            return 0;
+        }
+        *carry = have < (size_t)line_size - 1 ? have : (size_t)line_size - 1;
+        memmove(buf, buf + have - *carry, *carry);
+    }
+}
+
+static void *client_thread(void *arg)
+{
+    struct client *c = (struct client *)arg;
+    char *line = malloc(line_size);
+    char *buf = malloc(RECV_SIZE + line_size);
+    size_t carry = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    if (!line || !buf || c->failed) {
+        c->failed = true;
+        goto out;
+    }
+
+    unsigned long long interval = rate > 0 ? 1000000000ULL / rate : 0;
+    unsigned long long next = now_ns();
+
+    for (long seq = 0; seq < lines_per_conn; seq++) {
+        if (interval) {
+            /* Open loop: send on schedule and charge queueing delay to the server */
+            unsigned long long t = now_ns();
+            if (t < next) {
+                struct timespec ts = { (next - t) / 1000000000ULL, (next - t) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+        } else {
+            next = now_ns();
+        }
+
+        format_line(line, c->id, seq);
+        for (long off = 0; off < line_size;) {
+            ssize_t n = send(c->fd, line + off, line_size - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                c->failed = true;
+                goto out;
+            }
+            off += n;
+        }
+        c->bytes_sent += line_size;
+
+        if (await_line(c, line, buf, &carry) < 0) {
+            c->failed = true;
+            goto out;
+        }
+        c->latency_ns[c->completed++] = now_ns() - next;
+        next += interval;
+    }
+
+out:
+    /* Close right away: a pool-mode server may be waiting for this worker */
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    free(line);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const unsigned long long *sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0.0;
+    size_t idx = (size_t)(p * (n - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-U path] [-c conns] [-n lines] [-s size]\n"
+            "          [-r rate]\n"
+            "  -H host   server address (default: 127.0.0.1)\n"
+            "  -p port   server port (default: 9000)\n"
+            "  -U path   connect to the server's local socket at path instead\n"
+            "  -c conns  concurrent connections (default: 16)\n"
+            "  -n lines  lines sent per connection (default: 100)\n"
+            "  -s size   bytes per line including the newline (default: 64)\n"
+            "  -r rate   lines per second per connection; 0 sends the next line\n"
+            "            as soon as the previous replay arrives (default: 0)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:U:c:n:s:r:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'c':
+            conn_count = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            lines_per_conn = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            line_size = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    /* Room for the "c<id>:<seq>:" tag keeps every line unique */
+    if (conn_count <= 0 || lines_per_conn <= 0 || line_size < 32 || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct client *clients = calloc(conn_count, sizeof(*clients));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&start_barrier, NULL, conn_count + 1);
+
+    for (long i = 0; i < conn_count; i++) {
+        struct client *c = &clients[i];
+        c->id = i;
+        c->latency_ns = calloc(lines_per_conn, sizeof(*c->latency_ns));
+        c->fd = c->latency_ns ? connect_server() : -1;
+        c->failed = c->fd < 0;
+        if (pthread_create(&c->tid, NULL, client_thread, c) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    unsigned long long start = now_ns();
+    pthread_barrier_wait(&start_barrier);
+
+    size_t total = 0;
+    unsigned long long sent = 0, received = 0;
+    long failed = 0;
+    for (long i = 0; i < conn_count; i++) {
+        pthread_join(clients[i].tid, NULL);
+        total += clients[i].completed;
+        sent += clients[i].bytes_sent;
+        received += clients[i].bytes_received;
+        failed += clients[i].failed;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    unsigned long long *all = malloc((total ? total : 1) * sizeof(*all));
+    if (!all) {
+        perror("malloc");
+        return 1;
+    }
+    size_t k = 0;
+    for (long i = 0; i < conn_count; i++) {
+        memcpy(all + k, clients[i].latency_ns, clients[i].completed * sizeof(*all));
+        k += clients[i].completed;
+        free(clients[i].latency_ns);
+    }
+    qsort(all, total, sizeof(*all), cmp_ull);
+
+    printf("connections    %ld (%ld failed)\n", conn_count, failed);
+    printf("round trips    %zu in %.3f s\n", total, elapsed);
+    printf("throughput     %.0f lines/s, %.2f MiB/s sent, %.2f MiB/s replayed\n",
+           total / elapsed, sent / elapsed / (1 << 20), received / elapsed / (1 << 20));
+    printf("latency (us)   p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile_us(all, total, 0.50), percentile_us(all, total, 0.99),
+           percentile_us(all, total, 0.999), total ? all[total - 1] / 1000.0 : 0.0);
+
+    free(all);
+    free(clients);
+    pthread_barrier_destroy(&start_barrier);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,369 @@
+/**
+ * @file aesd-cache.c
+ * @brief In-process history cache for aesdsocket
+ *
+ * Each cached line is its own reference-counted allocation and the ring
+ * holds one reference to every line in it.  A replay takes a reference to
+ * each line it is about to send while holding the lock, then drops the lock
+ * for the sendmsg(), so an append can evict a line that is still being sent
+ * without freeing it underneath the sender, and a slow client never holds up
+ * writers.
+ *
+ * Lines are addressed by the same logical offsets as every store, so a
+ * range the cache no longer holds is passed to the backing store unchanged.
+ * The cache never serves more than the backing store holds: after every
+ * append it evicts the lines below the backing store's oldest byte, and
+ * replays skip that far just as the backing store's would, so -c changes
+ * where a reply comes from but never what it contains.
+ * In front of a store that captures rather than replays (the char device),
+ * the cache captures too, copying what it holds and asking the backing
+ * store for the rest.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "aesd-cache.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct cache_line {
+    unsigned refs;
+    off_t off;                  /* logical offset of data[0] */
+    size_t len;
+    char data[];
+};
+
+struct cache_store {
+    struct aesd_store store;
+    struct aesd_store *backing;
+    pthread_mutex_t lock;       /* guards everything below */
+    struct cache_line **ring;
+    size_t lines;               /* capacity of ring */
+    size_t head;                /* slot of the oldest cached line */
+    size_t count;
+    off_t oldest;               /* the backing store's oldest byte */
+    off_t end;                  /* logical offset one past the newest line */
+};
+
+static void cache_line_put(struct cache_line *line)
+{
+    if (__atomic_sub_fetch(&line->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(line);
+}
+
+/*
+ * Drop every cached line.  Used when a line cannot be mirrored, since the
+ * cached range must always end at the newest byte.  Caller holds the lock.
+ */
+static void cache_flush(struct cache_store *cs)
+{
+    for (size_t i = 0; i < cs->count; i++)
+        cache_line_put(cs->ring[(cs->head + i) % cs->lines]);
+    cs->head = 0;
+    cs->count = 0;
+}
+
+static size_t cache_append(struct aesd_store *store, struct iovec *iov, int iovcnt)
+{
+    struct cache_store *cs = (struct cache_store *)store;
+    size_t written = aesd_store_append(cs->backing, iov, iovcnt);
+    off_t oldest = aesd_store_oldest(cs->backing);
+
+    /* Only the newest cs->lines lines of the batch can survive */
+    int first = 0;
+    size_t skipped = 0;
+    if ((size_t)iovcnt > cs->lines) {
+        first = iovcnt - (int)cs->lines;
+        for (int i = 0; i < first; i++)
+            skipped += iov[i].iov_len;
+    }
+
+    /* Copy outside the lock; replays only wait for the ring update */
+    struct cache_line *added[iovcnt - first];
+    int nadded = 0;
+    size_t left = written > skipped ? written - skipped : 0;
+    off_t off = cs->end + (off_t)(written < skipped ? written : skipped);
+    bool complete = true;
+
+    for (int i = first; i < iovcnt && left > 0; i++) {
+        size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+        struct cache_line *line = malloc(sizeof(*line) + len);
+        if (!line) {
+            complete = false;
+            break;
+        }
+        line->refs = 1;
+        line->off = off;
+        line->len = len;
+        memcpy(line->data, iov[i].iov_base, len);
+        added[nadded++] = line;
+        off += len;
+        left -= len;
+    }
+
+    pthread_mutex_lock(&cs->lock);
+    if (!complete)
+        cache_flush(cs);
+    for (int i = 0; i < nadded; i++) {
+        if (!complete) {
+            cache_line_put(added[i]);
+            continue;
+        }
+        if (cs->count == cs->lines) {
+            cache_line_put(cs->ring[cs->head]);
+            cs->head = (cs->head + 1) % cs->lines;
+            cs->count--;
+        }
+        cs->ring[(cs->head + cs->count) % cs->lines] = added[i];
+        cs->count++;
+    }
+    cs->end += written;
+
+    /* Drop whatever the backing store has dropped */
+    while (cs->count > 0) {
+        struct cache_line *line = cs->ring[cs->head];
+        if (line->off + (off_t)line->len > oldest)
+            break;
+        cache_line_put(line);
+        cs->head = (cs->head + 1) % cs->lines;
+        cs->count--;
+    }
+    cs->oldest = oldest;
+    pthread_mutex_unlock(&cs->lock);
+
+    return written;
+}
+
+/* Slot index, counted from head, of the cached line holding logical offset off */
+static size_t cache_find(struct cache_store *cs, off_t off)
+{
+    size_t lo = 0, hi = cs->count;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cs->ring[(cs->head + mid) % cs->lines]->off <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Hold partial segments back while a replay switches from the backing store
+ * to the cache.  Not every socket is TCP, so failures are ignored.
+ */
+static void cache_cork(int sock_fd, int on)
+{
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static int cache_replay_range(struct cache_store *cs, int sock_fd, off_t *off, off_t end,
+                              bool *corked)
+{
+    struct cache_line *held[IOV_MAX];
+    struct iovec iov[IOV_MAX];
+
+    while (*off < end) {
+        pthread_mutex_lock(&cs->lock);
+        if (*off < cs->oldest)
+            *off = cs->oldest < end ? cs->oldest : end;
+        off_t from = *off;
+        off_t oldest = cs->count ? cs->ring[cs->head]->off : cs->end;
+
+        if (from < oldest) {
+            /* Evicted from the cache: the backing store serves the gap */
+            off_t stop = oldest;
+            pthread_mutex_unlock(&cs->lock);
+            if (stop > end)
+                stop = end;
+            if (stop < end && !*corked) {
+                cache_cork(sock_fd, 1);
+                *corked = true;
+            }
+            int rc = aesd_store_replay(cs->backing, sock_fd, off, stop);
+            if (rc < 0 || *off < stop)
+                return rc;
+            continue;
+        }
+        if (from >= cs->end) {
+            pthread_mutex_unlock(&cs->lock);
+            return 0;
+        }
+
+        int n = 0;
+        off_t batch_end = from;
+        for (size_t i = cache_find(cs, from); i < cs->count && n < IOV_MAX; i++) {
+            struct cache_line *line = cs->ring[(cs->head + i) % cs->lines];
+            if (line->off >= end)
+                break;
+            off_t skip = from > line->off ? from - line->off : 0;
+            off_t len = (off_t)line->len - skip;
+            if (line->off + (off_t)line->len > end)
+                len -= line->off + (off_t)line->len - end;
+            __atomic_add_fetch(&line->refs, 1, __ATOMIC_RELAXED);
+            held[n] = line;
+            iov[n].iov_base = line->data + skip;
+            iov[n].iov_len = len;
+            batch_end += len;
+            n++;
+        }
+        pthread_mutex_unlock(&cs->lock);
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        int flags = MSG_NOSIGNAL | (batch_end < end ? MSG_MORE : 0);
+        ssize_t sent;
+        do {
+            sent = sendmsg(sock_fd, &msg, flags);
+        } while (sent < 0 && errno == EINTR);
+
+        int saved_errno = errno;
+        for (int i = 0; i < n; i++)
+            cache_line_put(held[i]);
+        if (sent < 0) {
+            errno = saved_errno;
+            return -1;
+        }
+        *off += sent;
+    }
+    return 0;
+}
+
+static int cache_replay(struct aesd_store *store, int sock_fd, off_t *off, off_t end)
+{
+    struct cache_store *cs = (struct cache_store *)store;
+    bool corked = false;
+    int rc = cache_replay_range(cs, sock_fd, off, end, &corked);
+
+    if (corked) {
+        int saved_errno = errno;
+        cache_cork(sock_fd, 0);
+        errno = saved_errno;
+    }
+    return rc;
+}
+
+static ssize_t cache_capture(struct aesd_store *store, off_t *off, off_t end, char **buf)
+{
+    struct cache_store *cs = (struct cache_store *)store;
+    char *copy = NULL;
+    ssize_t len = 0;
+
+    pthread_mutex_lock(&cs->lock);
+    if (*off < cs->oldest)
+        *off = cs->oldest < end ? cs->oldest : end;
+    off_t oldest = cs->count ? cs->ring[cs->head]->off : cs->end;
+    off_t from = *off;
+
+    /* Evicted from the cache: the backing store supplies the head */
+    if (from < oldest) {
+        off_t stop = oldest < end ? oldest : end;
+        len = aesd_store_capture(cs->backing, off, stop, &copy);
+        if (len < 0 || *off + len < stop) {
+            pthread_mutex_unlock(&cs->lock);
+            *buf = copy;
+            return len;
+        }
+        from = stop;
+    }
+
+    if (from < end) {
+        char *tmp = realloc(copy, len + (end - from));
+        if (!tmp) {
+            pthread_mutex_unlock(&cs->lock);
+            free(copy);
+            return -1;
+        }
+        copy = tmp;
+        for (size_t i = cache_find(cs, from); i < cs->count && from < end; i++) {
+            struct cache_line *line = cs->ring[(cs->head + i) % cs->lines];
+            off_t skip = from - line->off;
+            off_t n = (off_t)line->len - skip;
+            if (n > end - from)
+                n = end - from;
+            memcpy(copy + len, line->data + skip, n);
+            len += n;
+            from += n;
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    *buf = copy;
+    return len;
+}
+
+static off_t cache_length(struct aesd_store *store)
+{
+    return ((struct cache_store *)store)->end;
+}
+
+static off_t cache_oldest(struct aesd_store *store)
+{
+    return ((struct cache_store *)store)->oldest;
+}
+
+static void cache_close(struct aesd_store *store)
+{
+    struct cache_store *cs = (struct cache_store *)store;
+
+    cache_flush(cs);
+    aesd_store_close(cs->backing);
+    pthread_mutex_destroy(&cs->lock);
+    free(cs->ring);
+    free(cs);
+}
+
+static const struct aesd_store_ops cache_ops = {
+    .append = cache_append,
+    .length = cache_length,
+    .oldest = cache_oldest,
+    .replay = cache_replay,
+    .close = cache_close,
+};
+
+static const struct aesd_store_ops cache_capture_ops = {
+    .append = cache_append,
+    .length = cache_length,
+    .oldest = cache_oldest,
+    .capture = cache_capture,
+    .close = cache_close,
+};
+
+struct aesd_store *aesd_cache_open(struct aesd_store *backing, size_t lines)
+{
+    if (lines == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct cache_store *cs = calloc(1, sizeof(*cs));
+    if (!cs)
+        return NULL;
+    cs->ring = calloc(lines, sizeof(*cs->ring));
+    if (!cs->ring) {
+        free(cs);
+        return NULL;
+    }
+    cs->store.ops = aesd_store_captures(backing) ? &cache_capture_ops : &cache_ops;
+    cs->store.name = backing->name;
+    cs->store.path = backing->path;
+    cs->backing = backing;
+    cs->lines = lines;
+    pthread_mutex_init(&cs->lock, NULL);
+
+    /* Whatever the backing store already holds is not cached */
+    cs->oldest = aesd_store_oldest(backing);
+    cs->end = aesd_store_length(backing);
+    return &cs->store;
+}
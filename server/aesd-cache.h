@@ -0,0 +1,32 @@
+/*
+ * aesd-cache.h
+ *
+ *  In-process cache of the newest lines of the aesdsocket history (-c).
+ *  It wraps any store from aesd-store.h: appends go to the backing store
+ *  first and are then mirrored into a ring of the last N appended lines, so
+ *  a replay whose range is still cached is sent from process memory with a
+ *  single sendmsg() and never reaches the backing store.  Older ranges fall
+ *  through to the backing store, and lines the backing store has dropped
+ *  (chardev, ring) are dropped from the cache too.
+ *
+ *  Locking: the same rules as any store; append(), length(), oldest() and
+ *  capture() must be serialized by the caller, replay() may run
+ *  concurrently with anything.  The cache captures exactly when its backing store does.
+ */
+
+#ifndef AESD_CACHE_H
+#define AESD_CACHE_H
+
+#include <stddef.h>
+
+#include "aesd-store.h"
+
+/**
+ * Put a cache of the last @param lines lines in front of @param backing.
+ * The cache takes ownership of @param backing and closes it with itself.
+ * @return the caching store, or NULL with errno set (and @param backing
+ * still owned by the caller)
+ */
+extern struct aesd_store *aesd_cache_open(struct aesd_store *backing, size_t lines);
+
+#endif /* AESD_CACHE_H */
@@ -0,0 +1,87 @@
+/*
+ * aesd-lock.h
+ *
+ *  Instrumented mutex for the serialization points of aesdsocket.
+ *
+ *  Every aesd_mutex counts the acquisitions that had to block and how long
+ *  they waited, which costs a clock read only when pthread_mutex_trylock()
+ *  fails.  Building with AESD_LOCK_STATS=1 additionally records a wait-time
+ *  and a hold-time histogram for every acquisition, at the price of two
+ *  clock reads per critical section.
+ */
+
+#ifndef AESD_LOCK_H
+#define AESD_LOCK_H
+
+#include <pthread.h>
+
+#include "aesd-stats.h"
+
+#ifndef AESD_LOCK_STATS
+#define AESD_LOCK_STATS 0
+#endif
+
+struct aesd_mutex
+{
+    pthread_mutex_t mutex;
+    /**
+     * Where this lock's contention is reported
+     */
+    enum aesd_stat waits_stat;
+    enum aesd_stat wait_ns_stat;
+    enum aesd_hist wait_hist;
+    enum aesd_hist hold_hist;
+    /**
+     * When the current holder acquired the lock; only touched by the holder
+     */
+    uint64_t locked_at;
+};
+
+/**
+ * Static initializer for a lock reporting to the AESD_STAT_<name>_* counters
+ * and AESD_HIST_<name>_* histograms
+ */
+#define AESD_MUTEX_INITIALIZER(name) { \
+    .mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .waits_stat = AESD_STAT_##name##_WAITS, \
+    .wait_ns_stat = AESD_STAT_##name##_WAIT_NS, \
+    .wait_hist = AESD_HIST_##name##_WAIT, \
+    .hold_hist = AESD_HIST_##name##_HOLD, \
+}
+
+static inline void aesd_mutex_lock(struct aesd_mutex *m)
+{
+    uint64_t wait = 0;
+
+    if (pthread_mutex_trylock(&m->mutex) != 0) {
+        uint64_t start = aesd_stats_now();
+        pthread_mutex_lock(&m->mutex);
+        wait = aesd_stats_now() - start;
+        aesd_stats_add(m->waits_stat, 1);
+        aesd_stats_add(m->wait_ns_stat, wait);
+    }
+#if AESD_LOCK_STATS
+    m->locked_at = aesd_stats_now();
+    aesd_stats_record(m->wait_hist, wait);
+#else
+    (void)wait;
+#endif
+}
+
+static inline void aesd_mutex_unlock(struct aesd_mutex *m)
+{
+#if AESD_LOCK_STATS
+    uint64_t held = aesd_stats_now() - m->locked_at;
+    pthread_mutex_unlock(&m->mutex);
+    aesd_stats_record(m->hold_hist, held);
+#else
+    pthread_mutex_unlock(&m->mutex);
+#endif
+}
+
+static inline void aesd_mutex_destroy(struct aesd_mutex *m)
+{
+    pthread_mutex_destroy(&m->mutex);
+}
+
+#endif /* AESD_LOCK_H */
@@ -0,0 +1,109 @@
+/**
+ * @file aesd-map.c
+ * @brief Memory-mapped history file for aesdsocket
+ *
+ * A MAP_SHARED mapping may extend past the end of its file; touching those
+ * pages raises SIGBUS, but the mapping itself is valid.  So the file is
+ * mapped once at its largest size and grown underneath the mapping, and
+ * every byte below its size is ordinary page cache.  Blocks are reserved
+ * ahead of the size, so growing the file per append is only an inode
+ * update.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd-map.h"
+
+int aesd_map_open(struct aesd_map *map, const char *path, size_t reserve)
+{
+    memset(map, 0, sizeof(*map));
+
+    map->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (map->fd < 0)
+        return -errno;
+
+    map->base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (map->base == MAP_FAILED) {
+        int err = -errno;
+        close(map->fd);
+        map->fd = -1;
+        map->base = NULL;
+        return err;
+    }
+    map->reserved = reserve;
+    return 0;
+}
+
+/* Reserve whole extents until the blocks cover [0, size) */
+static int aesd_map_reserve(struct aesd_map *map, size_t size)
+{
+    if (size > map->reserved)
+        return -ENOSPC;
+
+    size_t target = (size + AESD_MAP_EXTENT - 1) / AESD_MAP_EXTENT * AESD_MAP_EXTENT;
+    if (target > map->reserved)
+        target = map->reserved;
+
+    /* Filesystems without fallocate() get a sparse file instead */
+    if (fallocate(map->fd, FALLOC_FL_KEEP_SIZE, map->allocated,
+                  target - map->allocated) < 0 && errno != EOPNOTSUPP)
+        return -errno;
+    map->allocated = target;
+    return 0;
+}
+
+size_t aesd_map_write(struct aesd_map *map, size_t off, const struct iovec *iov,
+                      int iovcnt)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (off + total > map->allocated) {
+        int err = aesd_map_reserve(map, off + total);
+        if (err < 0) {
+            syslog(LOG_ERR, "growing mapped history: %s", strerror(-err));
+            return 0;
+        }
+    }
+    if (off + total > map->length) {
+        if (ftruncate(map->fd, off + total) < 0) {
+            syslog(LOG_ERR, "growing mapped history: %s", strerror(errno));
+            return 0;
+        }
+        map->length = off + total;
+    }
+
+    char *dst = map->base + off;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    return total;
+}
+
+void aesd_map_close(struct aesd_map *map, size_t size)
+{
+    if (map->base) {
+        munmap(map->base, map->reserved);
+        map->base = NULL;
+    }
+    if (map->fd >= 0) {
+        if (ftruncate(map->fd, size) < 0)
+            syslog(LOG_ERR, "truncating mapped history: %s", strerror(errno));
+        /* Truncating to the same size need not free blocks past it */
+        if (map->allocated > size)
+            fallocate(map->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size,
+                      map->allocated - size);
+        close(map->fd);
+        map->fd = -1;
+    }
+}
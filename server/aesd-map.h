@@ -0,0 +1,57 @@
+/*
+ * aesd-map.h
+ *
+ *  Memory-mapped history file for aesdsocket (-b mmap).  The whole address
+ *  range the file may ever reach is mapped once, so the base address never
+ *  moves and readers can send straight from it without taking any lock; only
+ *  the part below the file's size may be touched.  Blocks are reserved in
+ *  AESD_MAP_EXTENT steps with fallocate(FALLOC_FL_KEEP_SIZE), which leaves
+ *  the size alone, and each append then extends the file with ftruncate()
+ *  to exactly the bytes it writes, so the file never shows unwritten
+ *  padding and appends still land in blocks that already exist.
+ *
+ *  Locking: writers must be serialized by the caller.  A reader may access
+ *  [0, n) once a writer has published n (under the caller's lock).
+ */
+
+#ifndef AESD_MAP_H
+#define AESD_MAP_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * Bytes reserved whenever an append runs past the blocks already reserved
+ */
+#define AESD_MAP_EXTENT (8UL << 20)
+
+struct aesd_map
+{
+    int fd;
+    char *base;         /* start of the mapping; fixed for its lifetime */
+    size_t reserved;    /* length of the mapping, the most the file can hold */
+    size_t allocated;   /* bytes of the file backed by reserved blocks */
+    size_t length;      /* size of the file: every byte written so far */
+};
+
+/**
+ * Create or truncate @param path and map @param reserve bytes of address
+ * space for it.
+ * @return 0 on success or a negative errno value
+ */
+extern int aesd_map_open(struct aesd_map *map, const char *path, size_t reserve);
+
+/**
+ * Copy @param iov to offset @param off, growing the file as needed.
+ * @return the number of bytes copied, short only if the file could not grow
+ */
+extern size_t aesd_map_write(struct aesd_map *map, size_t off, const struct iovec *iov,
+                             int iovcnt);
+
+/**
+ * Unmap and close, releasing the reserved blocks past @param size and
+ * leaving the file exactly @param size bytes long
+ */
+extern void aesd_map_close(struct aesd_map *map, size_t size);
+
+#endif /* AESD_MAP_H */
@@ -0,0 +1,38 @@
+/*
+ * aesd-scan.h
+ *
+ *  Newline scanners for scan-bench to compare on the running CPU.
+ *
+ *  aesdsocket itself frames lines with libc memchr(), which measured
+ *  fastest, and does not link this.
+ */
+
+#ifndef AESD_SCAN_H
+#define AESD_SCAN_H
+
+#include <stddef.h>
+
+typedef const char *(*aesd_scan_fn)(const char *buf, size_t len);
+
+struct aesd_scan_impl
+{
+    /**
+     * Short name used in the benchmark output
+     */
+    const char *name;
+    /**
+     * Returns a pointer to the first '\n' in buf[0, len), or NULL
+     */
+    aesd_scan_fn scan;
+    /**
+     * Non-zero if the running CPU can execute scan
+     */
+    int (*supported)(void);
+};
+
+/**
+ * Every implementation, terminated by an entry with a NULL name
+ */
+extern const struct aesd_scan_impl aesd_scan_impls[];
+
+#endif /* AESD_SCAN_H */
@@ -0,0 +1,173 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per-thread runtime counters for aesdsocket
+ *
+ * A thread's block is allocated on its first event and linked into a global
+ * list, which is only locked when a block is added or retired and when a
+ * report is built.  The owning thread is the only writer of its block, so
+ * updates are relaxed load/store pairs that a concurrent reader can never
+ * see torn.  When the thread exits, a pthread key destructor adds the block
+ * into the retired totals, so thread-per-connection mode does not accumulate
+ * one block per connection ever served.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "aesd-stats.h"
+
+struct stats_block {
+    uint64_t counters[AESD_STAT_COUNT];
+    uint64_t hist[AESD_HIST_COUNT][AESD_STATS_HIST_BUCKETS];
+    LIST_ENTRY(stats_block) entries;
+} __attribute__((aligned(64)));
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, stats_block) stats_live = LIST_HEAD_INITIALIZER(stats_live);
+static struct stats_block stats_retired;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_block *stats_self;
+
+static void stats_merge(struct stats_block *into, const struct stats_block *from)
+{
+    for (int i = 0; i < AESD_STAT_COUNT; i++)
+        into->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+    for (int h = 0; h < AESD_HIST_COUNT; h++) {
+        for (int i = 0; i < AESD_STATS_HIST_BUCKETS; i++)
+            into->hist[h][i] += __atomic_load_n(&from->hist[h][i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Runs in the exiting thread, so nothing else writes the block any more */
+static void stats_retire(void *arg)
+{
+    struct stats_block *b = (struct stats_block *)arg;
+
+    pthread_mutex_lock(&stats_lock);
+    LIST_REMOVE(b, entries);
+    stats_merge(&stats_retired, b);
+    pthread_mutex_unlock(&stats_lock);
+    free(b);
+}
+
+static void stats_init_key(void)
+{
+    pthread_key_create(&stats_key, stats_retire);
+}
+
+/* The calling thread's block, or NULL if it could not be allocated */
+static struct stats_block *stats_get(void)
+{
+    if (stats_self)
+        return stats_self;
+
+    struct stats_block *b = aligned_alloc(64, sizeof(*b));
+    if (!b)
+        return NULL;
+    memset(b, 0, sizeof(*b));
+
+    pthread_once(&stats_once, stats_init_key);
+    pthread_mutex_lock(&stats_lock);
+    LIST_INSERT_HEAD(&stats_live, b, entries);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, b);
+    stats_self = b;
+    return b;
+}
+
+static inline void stats_bump(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+void aesd_stats_add(enum aesd_stat stat, uint64_t n)
+{
+    struct stats_block *b = stats_get();
+    if (b)
+        stats_bump(&b->counters[stat], n);
+}
+
+void aesd_stats_record(enum aesd_hist hist, uint64_t ns)
+{
+    struct stats_block *b = stats_get();
+    if (!b)
+        return;
+
+    uint64_t us = ns / 1000;
+    int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+    if (bucket >= AESD_STATS_HIST_BUCKETS)
+        bucket = AESD_STATS_HIST_BUCKETS - 1;
+    stats_bump(&b->hist[hist][bucket], 1);
+}
+
+uint64_t aesd_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t aesd_stats_format(char *buf, size_t len)
+{
+    static const char *const names[AESD_STAT_COUNT] = {
+        [AESD_STAT_CONNECTIONS] = "connections_accepted",
+        [AESD_STAT_LINES] = "lines_committed",
+        [AESD_STAT_BYTES_RECEIVED] = "bytes_received",
+        [AESD_STAT_BYTES_REPLAYED] = "bytes_replayed",
+        [AESD_STAT_DATA_MUTEX_WAITS] = "data_mutex_waits",
+        [AESD_STAT_DATA_MUTEX_WAIT_NS] = "data_mutex_wait_ns",
+        [AESD_STAT_REPLAYS] = "replays",
+    };
+    static const char *const hist_names[AESD_HIST_COUNT] = {
+        [AESD_HIST_REPLAY] = "replay_us",
+        [AESD_HIST_DATA_MUTEX_WAIT] = "data_mutex_wait_us",
+        [AESD_HIST_DATA_MUTEX_HOLD] = "data_mutex_hold_us",
+    };
+    struct stats_block total;
+    struct stats_block *b;
+    size_t off = 0;
+
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(&total, &stats_retired);
+    LIST_FOREACH(b, &stats_live, entries)
+        stats_merge(&total, b);
+    pthread_mutex_unlock(&stats_lock);
+
+#define STATS_APPEND(...) \
+    do { \
+        if (off < len) \
+            off += snprintf(buf + off, len - off, __VA_ARGS__); \
+    } while (0)
+
+    for (int i = 0; i < AESD_STAT_COUNT; i++)
+        STATS_APPEND("%s %llu\n", names[i], (unsigned long long)total.counters[i]);
+
+    /* Histograms are printed up to their highest non-empty bucket */
+    for (int h = 0; h < AESD_HIST_COUNT; h++) {
+        int last = -1;
+        for (int i = 0; i < AESD_STATS_HIST_BUCKETS; i++) {
+            if (total.hist[h][i])
+                last = i;
+        }
+        for (int i = 0; i <= last; i++) {
+            if (i == AESD_STATS_HIST_BUCKETS - 1)
+                STATS_APPEND("%s_ge_%llu %llu\n", hist_names[h], 1ULL << i,
+                             (unsigned long long)total.hist[h][i]);
+            else
+                STATS_APPEND("%s_lt_%llu %llu\n", hist_names[h], 2ULL << i,
+                             (unsigned long long)total.hist[h][i]);
+        }
+    }
+#undef STATS_APPEND
+
+    /* snprintf() reports the untruncated length; the buffer ends in a NUL */
+    return off < len ? off : (len ? len - 1 : 0);
+}
@@ -0,0 +1,73 @@
+/*
+ * aesd-stats.h
+ *
+ *  Runtime counters for aesdsocket.
+ *
+ *  Every thread updates its own cache-line-aligned block of counters, so
+ *  recording an event is a plain load and store with no locked instruction
+ *  and no sharing between cores.  aesd_stats_format() sums the blocks of all
+ *  live threads plus everything folded in by threads that have exited.
+ */
+
+#ifndef AESD_STATS_H
+#define AESD_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum aesd_stat {
+    AESD_STAT_CONNECTIONS,          /* connections accepted */
+    AESD_STAT_LINES,                /* lines committed to the history */
+    AESD_STAT_BYTES_RECEIVED,
+    AESD_STAT_BYTES_REPLAYED,
+    AESD_STAT_DATA_MUTEX_WAITS,     /* data_mutex acquisitions that had to block */
+    AESD_STAT_DATA_MUTEX_WAIT_NS,   /* total time spent blocked on data_mutex */
+    AESD_STAT_REPLAYS,
+    AESD_STAT_COUNT
+};
+
+enum aesd_hist {
+    AESD_HIST_REPLAY,               /* replay durations */
+    AESD_HIST_DATA_MUTEX_WAIT,      /* time to acquire data_mutex (AESD_LOCK_STATS) */
+    AESD_HIST_DATA_MUTEX_HOLD,      /* time data_mutex was held (AESD_LOCK_STATS) */
+    AESD_HIST_COUNT
+};
+
+/**
+ * Durations are bucketed by powers of two of microseconds: bucket 0 counts
+ * events under 2us and bucket i those in [2^i, 2^(i+1)) us, with the last
+ * bucket collecting everything longer
+ */
+#define AESD_STATS_HIST_BUCKETS 24
+
+/**
+ * Add @param n to counter @param stat for the calling thread
+ */
+extern void aesd_stats_add(enum aesd_stat stat, uint64_t n);
+
+/**
+ * Record one event that took @param ns nanoseconds in histogram @param hist
+ */
+extern void aesd_stats_record(enum aesd_hist hist, uint64_t ns);
+
+/**
+ * Record one replay that took @param ns nanoseconds
+ */
+static inline void aesd_stats_replay_done(uint64_t ns)
+{
+    aesd_stats_add(AESD_STAT_REPLAYS, 1);
+    aesd_stats_record(AESD_HIST_REPLAY, ns);
+}
+
+/**
+ * @return CLOCK_MONOTONIC in nanoseconds, for timing the events above
+ */
+extern uint64_t aesd_stats_now(void);
+
+/**
+ * Write a "name value" line per counter and histogram bucket to @param buf
+ * @return the length of the report, truncated to fit @param len
+ */
+extern size_t aesd_stats_format(char *buf, size_t len);
+
+#endif /* AESD_STATS_H */
@@ -0,0 +1,591 @@
+/**
+ * @file aesd-store.c
+ * @brief History storage backends for aesdsocket
+ *
+ * The chardev and file backends share one implementation around file
+ * descriptors: a read descriptor opened once and used with explicit offsets
+ * by every replay, and either a long-lived O_APPEND descriptor or one opened
+ * per append.  The driver renumbers its positions whenever an append evicts
+ * an entry, so the chardev backend only copies ranges out with capture(),
+ * which the caller serializes with appends, mapping logical offsets to
+ * positions with the base the last append left.  The mmap backend wraps
+ * aesd-map.c.  The ring
+ * backend keeps the newest ring_size bytes in memory and skips whatever has
+ * been overwritten when a replay falls behind.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "aesd-map.h"
+#include "aesd-store.h"
+
+#define STORE_CHUNK 65536       /* one pipe's worth; also the bounce buffer size */
+
+/*
+ * Flag for a send that ends at offset next of a replay ending at end.  Every
+ * send but the last carries MSG_MORE so chunk boundaries never leave a short
+ * segment on the wire; the last one pushes whatever is queued.
+ */
+static int more_flag(off_t next, off_t end)
+{
+    return next < end ? MSG_MORE : 0;
+}
+
+/*
+ * chardev and file
+ */
+
+struct fd_store {
+    struct aesd_store store;
+    int append_fd;              /* with keep_open, else -1 */
+    int read_fd;
+    bool device;                /* never remove */
+    /* Set once the running kernel refuses a zero-copy path for read_fd */
+    bool sendfile_unsupported;
+    bool splice_unsupported;
+    off_t end;                  /* logical offset one past the newest byte */
+    off_t base;                 /* chardev: logical offset of device position 0 */
+};
+
+/*
+ * Write every byte described by iov to fd, retrying short writes.
+ * Returns the number of bytes actually written.
+ */
+static size_t write_iov_all(int fd, const char *path, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "write failed: %s", strerror(errno));
+            break;
+        }
+        if (written == 0) {
+            syslog(LOG_ERR, "incomplete write to %s", path);
+            break;
+        }
+        total += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+static size_t fd_store_append(struct aesd_store *store, struct iovec *iov, int iovcnt)
+{
+    struct fd_store *fs = (struct fd_store *)store;
+    size_t written;
+
+    if (fs->append_fd >= 0) {
+        written = write_iov_all(fs->append_fd, store->path, iov, iovcnt);
+    } else {
+        /* Open fd, write, close — do not hold fd across connection */
+        int fd = open(store->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            syslog(LOG_ERR, "open %s: %s", store->path, strerror(errno));
+            return 0;
+        }
+        written = write_iov_all(fd, store->path, iov, iovcnt);
+        close(fd);
+    }
+    fs->end += written;
+    return written;
+}
+
+static off_t fd_store_length(struct aesd_store *store)
+{
+    return ((struct fd_store *)store)->end;
+}
+
+/*
+ * Append to the device and ask it how much it still holds, which is where
+ * the logical offsets now start.
+ */
+static size_t dev_store_append(struct aesd_store *store, struct iovec *iov, int iovcnt)
+{
+    struct fd_store *fs = (struct fd_store *)store;
+    size_t written = fd_store_append(store, iov, iovcnt);
+
+    off_t held = lseek(fs->read_fd, 0, SEEK_END);
+    if (held >= 0 && held <= fs->end)
+        fs->base = fs->end - held;
+    return written;
+}
+
+/* Move [*off, end) of in_fd to sock_fd through a pipe with splice() */
+static int splice_range(int in_fd, int sock_fd, off_t *off, off_t end)
+{
+    int pipefd[2];
+    int rc = 0;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+
+    while (*off < end) {
+        loff_t in_off = *off;
+        size_t want = STORE_CHUNK;
+        if ((off_t)want > end - *off)
+            want = end - *off;
+
+        ssize_t nread = splice(in_fd, &in_off, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0) {
+            rc = nread;
+            break;
+        }
+
+        /*
+         * Bytes left in the pipe when the socket would block are dropped
+         * with it; *off only counts what reached the socket, so the next
+         * call simply re-reads them.
+         */
+        while (nread > 0) {
+            unsigned int flags = SPLICE_F_MOVE;
+            if (*off + nread < end)
+                flags |= SPLICE_F_MORE;
+            ssize_t sent = splice(pipefd[0], NULL, sock_fd, NULL, nread, flags);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                rc = -1;
+                goto out;
+            }
+            nread -= sent;
+            *off += sent;
+        }
+    }
+
+out:
+    {
+        int saved_errno = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved_errno;
+    }
+    return rc;
+}
+
+/*
+ * Uses sendfile() where the kernel supports it for the backing file,
+ * splice() through a pipe otherwise, and finally a buffered pread()/send()
+ * loop.  Offsets are always explicit, so replays share read_fd.
+ */
+static int fd_store_replay(struct aesd_store *store, int sock_fd, off_t *off, off_t end)
+{
+    struct fd_store *fs = (struct fd_store *)store;
+    int in_fd = fs->read_fd;
+
+    while (*off < end && !fs->sendfile_unsupported) {
+        ssize_t sent = sendfile(sock_fd, in_fd, off, end - *off);
+        if (sent > 0)
+            continue;
+        if (sent == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+        fs->sendfile_unsupported = true;
+    }
+
+    if (*off < end && !fs->splice_unsupported) {
+        if (splice_range(in_fd, sock_fd, off, end) == 0)
+            return 0;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+        fs->splice_unsupported = true;
+    }
+
+    char buf[STORE_CHUNK];
+    while (*off < end) {
+        size_t want = sizeof(buf);
+        if ((off_t)want > end - *off)
+            want = end - *off;
+
+        ssize_t nread = pread(in_fd, buf, want, *off);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            return nread;
+
+        ssize_t total_sent = 0;
+        while (total_sent < nread) {
+            ssize_t sent = send(sock_fd, buf + total_sent, nread - total_sent,
+                                MSG_NOSIGNAL | more_flag(*off + nread - total_sent, end));
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            total_sent += sent;
+            *off += sent;
+        }
+    }
+    return 0;
+}
+
+/* Where the device now starts, as of the last append */
+static off_t dev_store_oldest(struct aesd_store *store)
+{
+    return ((struct fd_store *)store)->base;
+}
+
+/* Copy a range out of the device; no append can move base meanwhile */
+static ssize_t dev_store_capture(struct aesd_store *store, off_t *off, off_t end,
+                                 char **buf)
+{
+    struct fd_store *fs = (struct fd_store *)store;
+
+    *buf = NULL;
+    if (*off < fs->base)
+        *off = fs->base < end ? fs->base : end;
+    if (*off >= end)
+        return 0;
+
+    size_t want = end - *off;
+    char *copy = malloc(want);
+    if (!copy)
+        return -1;
+
+    size_t got = 0;
+    while (got < want) {
+        ssize_t nread = pread(fs->read_fd, copy + got, want - got, *off - fs->base + got);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0) {
+            int saved_errno = errno;
+            free(copy);
+            errno = saved_errno;
+            return -1;
+        }
+        if (nread == 0)
+            break;
+        got += nread;
+    }
+    *buf = copy;
+    return got;
+}
+
+static void fd_store_close(struct aesd_store *store)
+{
+    struct fd_store *fs = (struct fd_store *)store;
+
+    if (fs->append_fd >= 0)
+        close(fs->append_fd);
+    if (fs->read_fd >= 0)
+        close(fs->read_fd);
+    if (!fs->device)
+        remove(store->path);
+    free(fs);
+}
+
+static const struct aesd_store_ops chardev_ops = {
+    .append = dev_store_append,
+    .length = fd_store_length,
+    .oldest = dev_store_oldest,
+    .capture = dev_store_capture,
+    .close = fd_store_close,
+};
+
+static const struct aesd_store_ops file_ops = {
+    .append = fd_store_append,
+    .length = fd_store_length,
+    .replay = fd_store_replay,
+    .close = fd_store_close,
+};
+
+static struct aesd_store *fd_store_open(const struct aesd_store_config *config,
+                                        bool device)
+{
+    struct fd_store *fs = calloc(1, sizeof(*fs));
+    if (!fs)
+        return NULL;
+    fs->store.ops = device ? &chardev_ops : &file_ops;
+    fs->store.name = device ? "chardev" : "file";
+    fs->store.path = config->path;
+    fs->device = device;
+    fs->append_fd = -1;
+
+    if (!device)
+        remove(config->path);
+
+    /* Appending first creates the file before it is opened for reading */
+    if (config->keep_open || !device) {
+        fs->append_fd = open(config->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fs->append_fd < 0)
+            goto fail;
+    }
+    fs->read_fd = open(config->path, O_RDONLY | O_CLOEXEC);
+    if (fs->read_fd < 0)
+        goto fail;
+
+    if (!config->keep_open && fs->append_fd >= 0) {
+        close(fs->append_fd);
+        fs->append_fd = -1;
+    }
+
+    /* The driver keeps history across runs; it is logical [0, held) */
+    if (device) {
+        off_t held = lseek(fs->read_fd, 0, SEEK_END);
+        fs->end = held > 0 ? held : 0;
+    }
+    return &fs->store;
+
+fail:
+    {
+        int saved_errno = errno;
+        if (fs->append_fd >= 0)
+            close(fs->append_fd);
+        free(fs);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+/*
+ * mmap
+ */
+
+struct map_store {
+    struct aesd_store store;
+    struct aesd_map map;
+    size_t end;                 /* bytes appended */
+};
+
+static size_t map_store_append(struct aesd_store *store, struct iovec *iov, int iovcnt)
+{
+    struct map_store *ms = (struct map_store *)store;
+    size_t written = aesd_map_write(&ms->map, ms->end, iov, iovcnt);
+
+    ms->end += written;
+    return written;
+}
+
+/* Send straight from the mapping; no open(), no bounce buffer */
+static int map_store_replay(struct aesd_store *store, int sock_fd, off_t *off, off_t end)
+{
+    struct map_store *ms = (struct map_store *)store;
+
+    while (*off < end) {
+        ssize_t sent = send(sock_fd, ms->map.base + *off, end - *off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        *off += sent;
+    }
+    return 0;
+}
+
+static off_t map_store_length(struct aesd_store *store)
+{
+    return ((struct map_store *)store)->end;
+}
+
+static void map_store_close(struct aesd_store *store)
+{
+    struct map_store *ms = (struct map_store *)store;
+
+    aesd_map_close(&ms->map, ms->end);
+    remove(store->path);
+    free(ms);
+}
+
+static const struct aesd_store_ops map_ops = {
+    .append = map_store_append,
+    .length = map_store_length,
+    .replay = map_store_replay,
+    .close = map_store_close,
+};
+
+static struct aesd_store *map_store_open(const struct aesd_store_config *config)
+{
+    struct map_store *ms = calloc(1, sizeof(*ms));
+    if (!ms)
+        return NULL;
+    ms->store.ops = &map_ops;
+    ms->store.name = "mmap";
+    ms->store.path = config->path;
+
+    int err = aesd_map_open(&ms->map, config->path, config->map_reserve);
+    if (err < 0) {
+        free(ms);
+        errno = -err;
+        return NULL;
+    }
+    return &ms->store;
+}
+
+/*
+ * ring
+ *
+ * Appends take the write side of the rwlock; replays copy out one chunk at
+ * a time under the read side and send it after dropping the lock, so a slow
+ * client never holds up writers for longer than one memcpy().
+ */
+
+struct ring_store {
+    struct aesd_store store;
+    pthread_rwlock_t lock;
+    char *buf;
+    size_t size;
+    off_t end;                  /* logical bytes ever appended */
+};
+
+static size_t ring_store_append(struct aesd_store *store, struct iovec *iov, int iovcnt)
+{
+    struct ring_store *rs = (struct ring_store *)store;
+    size_t total = 0;
+
+    pthread_rwlock_wrlock(&rs->lock);
+    for (int i = 0; i < iovcnt; i++) {
+        const char *src = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        total += len;
+        /* Only the last size bytes of an oversized write survive */
+        if (len > rs->size) {
+            rs->end += len - rs->size;
+            src += len - rs->size;
+            len = rs->size;
+        }
+        size_t pos = rs->end % rs->size;
+        size_t first = len < rs->size - pos ? len : rs->size - pos;
+        memcpy(rs->buf + pos, src, first);
+        memcpy(rs->buf, src + first, len - first);
+        rs->end += len;
+    }
+    pthread_rwlock_unlock(&rs->lock);
+    return total;
+}
+
+/* Caller holds the lock or is serialized with appends */
+static off_t ring_oldest(const struct ring_store *rs)
+{
+    return rs->end > (off_t)rs->size ? rs->end - (off_t)rs->size : 0;
+}
+
+static int ring_store_replay(struct aesd_store *store, int sock_fd, off_t *off, off_t end)
+{
+    struct ring_store *rs = (struct ring_store *)store;
+    char buf[STORE_CHUNK];
+
+    while (*off < end) {
+        pthread_rwlock_rdlock(&rs->lock);
+        off_t oldest = ring_oldest(rs);
+        if (*off < oldest)
+            *off = oldest < end ? oldest : end;
+        size_t want = sizeof(buf);
+        if ((off_t)want > end - *off)
+            want = end - *off;
+        size_t pos = *off % rs->size;
+        size_t first = want < rs->size - pos ? want : rs->size - pos;
+        memcpy(buf, rs->buf + pos, first);
+        memcpy(buf + first, rs->buf, want - first);
+        pthread_rwlock_unlock(&rs->lock);
+
+        /* Bytes not sent are copied again on the next call */
+        size_t total_sent = 0;
+        while (total_sent < want) {
+            ssize_t sent = send(sock_fd, buf + total_sent, want - total_sent,
+                                MSG_NOSIGNAL | more_flag(*off + want - total_sent, end));
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            total_sent += sent;
+            *off += sent;
+        }
+    }
+    return 0;
+}
+
+/* Appends are serialized with this, so end needs no lock */
+static off_t ring_store_length(struct aesd_store *store)
+{
+    return ((struct ring_store *)store)->end;
+}
+
+static off_t ring_store_oldest(struct aesd_store *store)
+{
+    return ring_oldest((struct ring_store *)store);
+}
+
+static void ring_store_close(struct aesd_store *store)
+{
+    struct ring_store *rs = (struct ring_store *)store;
+
+    pthread_rwlock_destroy(&rs->lock);
+    free(rs->buf);
+    free(rs);
+}
+
+static const struct aesd_store_ops ring_ops = {
+    .append = ring_store_append,
+    .length = ring_store_length,
+    .oldest = ring_store_oldest,
+    .replay = ring_store_replay,
+    .close = ring_store_close,
+};
+
+static struct aesd_store *ring_store_open(const struct aesd_store_config *config)
+{
+    if (config->ring_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ring_store *rs = calloc(1, sizeof(*rs));
+    if (!rs)
+        return NULL;
+    rs->store.ops = &ring_ops;
+    rs->store.name = "ring";
+    rs->size = config->ring_size;
+    rs->buf = malloc(rs->size);
+    if (!rs->buf) {
+        free(rs);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_rwlock_init(&rs->lock, NULL);
+    return &rs->store;
+}
+
+struct aesd_store *aesd_store_open(const char *name, const struct aesd_store_config *config)
+{
+    if (strcmp(name, "chardev") == 0)
+        return fd_store_open(config, true);
+    if (strcmp(name, "file") == 0)
+        return fd_store_open(config, false);
+    if (strcmp(name, "mmap") == 0)
+        return map_store_open(config);
+    if (strcmp(name, "ring") == 0)
+        return ring_store_open(config);
+    errno = EINVAL;
+    return NULL;
+}
@@ -0,0 +1,138 @@
+/*
+ * aesd-store.h
+ *
+ *  Storage backends for the aesdsocket history.  Every backend implements
+ *  the same operations, so the server picks one at runtime and never needs
+ *  to know where the bytes live:
+ *
+ *   chardev  the aesdchar driver, which keeps only its most recent writes
+ *            and renumbers what it keeps as it drops old ones
+ *   file     a regular file written with O_APPEND and replayed with
+ *            sendfile()/splice()
+ *   mmap     the same file kept mapped (aesd-map.h); appends are memcpy()
+ *            into the mapping and replays send() straight from it
+ *   ring     a fixed-size ring buffer in memory; nothing touches the disk
+ *
+ *  Offsets are logical: they count every byte the store has ever held,
+ *  including whatever it held when opened, and never shift.  A backend that
+ *  drops old bytes (chardev, ring) maps them to its own positions itself and
+ *  skips whatever it no longer holds.
+ *
+ *  Locking: append(), length(), oldest() and capture() must be serialized
+ *  by the caller.  replay() may run concurrently with them and with other replays,
+ *  for any range the caller has seen committed.  The char device renumbers
+ *  its positions on every append that evicts an entry, so it has capture()
+ *  instead of replay(): the caller copies a range out while appends are held
+ *  off and sends the copy afterwards.
+ */
+
+#ifndef AESD_STORE_H
+#define AESD_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct aesd_store;
+
+struct aesd_store_ops
+{
+    /**
+     * Append every byte of @param iov
+     * @return the number of bytes stored
+     */
+    size_t (*append)(struct aesd_store *store, struct iovec *iov, int iovcnt);
+    /**
+     * @return the logical length of the history: the offset one past the
+     * newest byte, and so the end of a snapshot taken now
+     */
+    off_t (*length)(struct aesd_store *store);
+    /**
+     * @return the logical offset of the oldest byte still held, below which
+     * every replay or capture skips.  NULL for stores that keep everything.
+     */
+    off_t (*oldest)(struct aesd_store *store);
+    /**
+     * Send [*off, end) to @param sock_fd, advancing *off by what was sent.
+     * Reaching the end of what is stored early ends the replay.
+     * @return 0 on completion or -1 with errno set, EAGAIN meaning a
+     * non-blocking socket filled up.  NULL where capture() is set.
+     */
+    int (*replay)(struct aesd_store *store, int sock_fd, off_t *off, off_t end);
+    /**
+     * Only for the char device, or a cache in front of it; NULL elsewhere.
+     * Copy [*off, end) into a malloc()ed buffer returned in @param buf,
+     * first advancing *off past whatever the store no longer holds.
+     * @return the number of bytes copied, which only falls short of
+     * end - *off if the store shrank behind its back, or -1 with errno set
+     */
+    ssize_t (*capture)(struct aesd_store *store, off_t *off, off_t end, char **buf);
+    void (*close)(struct aesd_store *store);
+};
+
+struct aesd_store
+{
+    const struct aesd_store_ops *ops;
+    const char *name;
+    const char *path;       /* backing file or device, NULL for ring */
+};
+
+struct aesd_store_config
+{
+    const char *path;       /* chardev, file and mmap */
+    bool keep_open;         /* file, chardev: one O_APPEND descriptor for life */
+    size_t map_reserve;     /* mmap: address space, the most it can hold */
+    size_t ring_size;       /* ring: bytes of history kept */
+};
+
+/**
+ * Open the backend called @param name ("chardev", "file", "mmap" or "ring").
+ * The file and mmap backends start from an empty file and remove it again
+ * when closed; the char device keeps whatever it already holds, which is
+ * counted in length().
+ * @return the store, or NULL with errno set (EINVAL for an unknown name)
+ */
+extern struct aesd_store *aesd_store_open(const char *name,
+                                          const struct aesd_store_config *config);
+
+static inline size_t aesd_store_append(struct aesd_store *store, struct iovec *iov,
+                                       int iovcnt)
+{
+    return store->ops->append(store, iov, iovcnt);
+}
+
+static inline off_t aesd_store_length(struct aesd_store *store)
+{
+    return store->ops->length(store);
+}
+
+static inline int aesd_store_replay(struct aesd_store *store, int sock_fd, off_t *off,
+                                    off_t end)
+{
+    return store->ops->replay(store, sock_fd, off, end);
+}
+
+static inline off_t aesd_store_oldest(struct aesd_store *store)
+{
+    return store->ops->oldest ? store->ops->oldest(store) : 0;
+}
+
+/* Whether replies must be captured rather than replayed (see above) */
+static inline bool aesd_store_captures(const struct aesd_store *store)
+{
+    return store->ops->capture != NULL;
+}
+
+static inline ssize_t aesd_store_capture(struct aesd_store *store, off_t *off, off_t end,
+                                         char **buf)
+{
+    return store->ops->capture(store, off, end, buf);
+}
+
+static inline void aesd_store_close(struct aesd_store *store)
+{
+    store->ops->close(store);
+}
+
+#endif /* AESD_STORE_H */
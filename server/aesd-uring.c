@@ -0,0 +1,165 @@
+/**
+ * @file aesd-uring.c
+ * @brief Raw-syscall io_uring ring management for aesdsocket
+ *
+ * Follows the ring protocol described in io_uring(7): the application owns
+ * the SQ tail and CQ head, the kernel owns the SQ head and CQ tail, and each
+ * side publishes its index with release semantics and reads the other's with
+ * acquire semantics.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "aesd-uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, const sigset_t *sig)
+{
+    /* The kernel's sigset is _NSIG bits, not glibc's larger sigset_t */
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                        sig, _NSIG / 8);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int aesd_uring_init(struct aesd_uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sqe_head = ring->sqe_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    err = -errno;
+    aesd_uring_exit(ring);
+    return err;
+}
+
+void aesd_uring_exit(struct aesd_uring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int aesd_uring_submit_and_wait(struct aesd_uring *ring, unsigned wait_nr,
+                               const sigset_t *sigmask)
+{
+    unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    /* SQEs are used in order, so array slot i always names SQE i */
+    for (unsigned i = ring->sqe_head; i != ring->sqe_tail; i++)
+        ring->sq_array[i & *ring->sq_mask] = i & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->sqe_head = ring->sqe_tail;
+
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
+
+    ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, sigmask);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *aesd_uring_peek_cqe(struct aesd_uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void aesd_uring_cqe_seen(struct aesd_uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int aesd_uring_register_buffers(struct aesd_uring *ring, const struct iovec *iov,
+                                unsigned nr)
+{
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0)
+        return -errno;
+    return 0;
+}
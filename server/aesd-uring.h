@@ -0,0 +1,97 @@
+/*
+ * aesd-uring.h
+ *
+ *  Minimal io_uring wrapper for aesdsocket, built on the raw system calls so
+ *  the server does not depend on liburing.  Only compiled with USE_IO_URING=1.
+ *
+ *  Locking: a ring is owned by a single thread; none of these functions are
+ *  safe to call concurrently on the same ring.
+ */
+
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct aesd_uring
+{
+    int fd;
+    /**
+     * Submission queue, shared with the kernel
+     */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    /**
+     * SQEs handed out by aesd_uring_get_sqe() run from sqe_head to sqe_tail;
+     * they become visible to the kernel on the next submit
+     */
+    unsigned sqe_head;
+    unsigned sqe_tail;
+    /**
+     * Completion queue, shared with the kernel
+     */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /**
+     * Mappings released by aesd_uring_exit()
+     */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * Create a ring with at least @param entries submission slots.
+ * @return 0 on success or a negative errno value
+ */
+extern int aesd_uring_init(struct aesd_uring *ring, unsigned entries);
+
+extern void aesd_uring_exit(struct aesd_uring *ring);
+
+/**
+ * @return a zeroed SQE to fill in, or NULL if every slot is already queued
+ * (call aesd_uring_submit() and try again)
+ */
+extern struct io_uring_sqe *aesd_uring_get_sqe(struct aesd_uring *ring);
+
+/**
+ * Hand every queued SQE to the kernel and wait for at least @param wait_nr
+ * completions.  If @param sigmask is not NULL it is installed for the
+ * duration of the wait, as with pselect().
+ * @return the number of SQEs consumed or a negative errno value
+ */
+extern int aesd_uring_submit_and_wait(struct aesd_uring *ring, unsigned wait_nr,
+                                      const sigset_t *sigmask);
+
+static inline int aesd_uring_submit(struct aesd_uring *ring)
+{
+    return aesd_uring_submit_and_wait(ring, 0, NULL);
+}
+
+/**
+ * @return the oldest unconsumed CQE, or NULL if the completion queue is empty.
+ * Release it with aesd_uring_cqe_seen() once it has been handled.
+ */
+extern struct io_uring_cqe *aesd_uring_peek_cqe(struct aesd_uring *ring);
+
+extern void aesd_uring_cqe_seen(struct aesd_uring *ring);
+
+/**
+ * Register @param nr buffers for IORING_OP_READ_FIXED/WRITE_FIXED
+ * @return 0 on success or a negative errno value
+ */
+extern int aesd_uring_register_buffers(struct aesd_uring *ring, const struct iovec *iov,
+                                       unsigned nr);
+
+#endif /* AESD_URING_H */
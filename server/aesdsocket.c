@@ -2,8 +2,11 @@
  * aesdsocket.c - Multi-threaded stream socket server for AESD Assignment 6 Part 1.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -12,331 +15,2680 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/queue.h>
 #include <time.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "aesd-lock.h"
+#include "aesd-stats.h"
+#include "aesd-cache.h"
+#include "aesd-store.h"
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
 #endif
 
+/* Build the io_uring engine (-m uring); needs Linux 5.6 or later to run */
+#ifndef USE_IO_URING
+#define USE_IO_URING 0
+#endif
+
+#if USE_IO_URING
+#include "aesd-uring.h"
+#define URING_MODE_NAME "|uring"
+#else
+#define URING_MODE_NAME ""
+#endif
+
+
 #define PORT 9000
 #define BACKLOG 10
 #define BUF_SIZE 1024
+#define MAX_EVENTS 64
+#define DEFAULT_QUEUE_DEPTH 128
+#define REPLAY_CHUNK 65536      /* one pipe's worth; also the fallback read size */
+#define COMMIT_BATCH_MAX 64     /* lines coalesced into one writev() */
+#define TIMESTAMP_INTERVAL 10   /* seconds between timestamp lines */
+#define DEFAULT_DRAIN_TIMEOUT 5 /* seconds open connections get to finish */
 
+#define CHAR_DEVICE "/dev/aesdchar"
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define RING_SIZE ((size_t)64 << 20)   /* history kept by -b ring */
+
+/* Address space mapped for DATA_FILE by -b mmap: the most history it can hold */
+#define MAP_RESERVE (sizeof(void *) == 8 ? (size_t)64 << 30 : (size_t)1 << 30)
+
+/* USE_AESD_CHAR_DEVICE only picks the default history backend (-b) */
 #if USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
+#define DEFAULT_BACKEND "chardev"
 #else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
+#define DEFAULT_BACKEND "file"
 #endif
 
+enum server_mode {
+    MODE_THREAD,    /* one pthread per accepted connection */
+    MODE_POOL,      /* fixed worker pool fed by a bounded queue of accepted fds */
+    MODE_EPOLL,     /* edge-triggered epoll reactor on a fixed set of threads */
+    MODE_URING,     /* single-threaded io_uring engine (USE_IO_URING builds) */
+};
+
 static int server_fd = -1;
 static volatile sig_atomic_t caught_signal = 0;
+static enum server_mode server_mode = MODE_THREAD;
+static long reactor_count = 0;
+static long worker_count = 0;
+static long queue_depth = DEFAULT_QUEUE_DEPTH;
+static bool group_commit = false;
+static bool incremental_replay = false;
+static bool reuseport = false;  /* -r: one SO_REUSEPORT socket per accept thread */
+static long reuseport_count = 1;
+static long listener_count = 1;
+static int *listen_fds = NULL;  /* listener_count sockets; server_fd is the first */
+/* More than one listening socket: each gets its own accept thread */
+static bool multi_listen = false;
+
+/* -l: what to listen on.  Without -l, IPv4 TCP on PORT. */
+enum listen_kind {
+    LISTEN_TCP,     /* IPv4 */
+    LISTEN_TCP6,    /* IPv6, also taking IPv4 unless a LISTEN_TCP is configured */
+    LISTEN_UNIX,    /* local stream socket at path */
+};
+
+#define MAX_LISTEN_SPECS 4
+
+struct listen_spec {
+    enum listen_kind kind;
+    const char *path;       /* LISTEN_UNIX */
+};
+
+static struct listen_spec listen_specs[MAX_LISTEN_SPECS];
+static int listen_spec_count = 0;
+static bool pin_threads = false;
+static const char *stats_path = NULL;  /* -s: local socket serving counters */
+static long drain_timeout = DEFAULT_DRAIN_TIMEOUT;  /* -D */
+static const char *backend = DEFAULT_BACKEND;     /* -b */
+static long cache_lines = 0;                        /* -c, 0 = no cache */
+static int send_buffer = 0;                         /* -S, 0 = kernel default */
+static int receive_buffer = 0;                      /* -R, 0 = kernel default */
+static struct aesd_store *store = NULL;
+/* Every backend but the char device gets a timestamp line every 10 seconds */
+static bool timestamps = false;
 
 struct thread_entry {
     pthread_t tid;
-    int client_fd;
-    volatile bool complete;
+    int client_fd;          /* -1 once the connection thread has closed it */
+    bool complete;
     SLIST_ENTRY(thread_entry) entries;
 };
 
 SLIST_HEAD(thread_list, thread_entry) thread_head = SLIST_HEAD_INITIALIZER(thread_head);
+/*
+ * Guards the list and each entry's client_fd and complete.  Only contended
+ * when several accept threads (-r, -l) spawn connections.
+ */
+static pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * data_mutex serializes writers of the store.  data_committed is the number of
+ * bytes fully appended so far; it only advances under data_mutex once a write
+ * has returned, so a reader that snapshots it can stream [0, data_committed)
+ * without holding the lock and never observe a half-written line.
+ */
+static struct aesd_mutex data_mutex = AESD_MUTEX_INITIALIZER(DATA_MUTEX);
+static off_t data_committed = 0;
 
-static pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * History offsets are logical: they count every byte ever committed, plus
+ * whatever the char device already held at startup, and never shift.  The
+ * store maps them to its own positions when it replays (see aesd-store.h).
+ * A store whose positions move under concurrent reads (the char device) is
+ * instead copied out under data_mutex, so the reply is exactly what the
+ * history held when the line was committed, however many entries the
+ * driver evicts before it is sent.
+ */
+struct history_snapshot {
+    off_t start;    /* first logical byte the client still needs */
+    off_t end;      /* committed length */
+    char *copy;     /* [start, end) captured from the store, or NULL */
+};
 
 static void signal_handler(int signo)
 {
     caught_signal = signo;
 }
 
-static void cleanup(void)
+static void close_listeners(void)
 {
-    if (server_fd >= 0)
+    if (listen_fds) {
+        for (long i = 0; i < listener_count; i++) {
+            if (listen_fds[i] >= 0)
+                close(listen_fds[i]);
+        }
+        free(listen_fds);
+        listen_fds = NULL;
+        for (int i = 0; i < listen_spec_count; i++) {
+            if (listen_specs[i].kind == LISTEN_UNIX)
+                unlink(listen_specs[i].path);
+        }
+    } else if (server_fd >= 0) {
         close(server_fd);
-#if !USE_AESD_CHAR_DEVICE
-    remove(DATA_FILE);
-#endif
+    }
+    server_fd = -1;
+}
+
+static void cleanup(void)
+{
+    close_listeners();
+    if (store) {
+        aesd_store_close(store);
+        store = NULL;
+    }
     closelog();
 }
 
-/* Send all contents of DATA_FILE to the client */
-static int send_file_contents(int client_fd)
+/*
+ * Append iov to the store and advance data_committed by what it took.
+ * Caller must hold data_mutex.
+ */
+static void append_history(struct iovec *iov, int iovcnt)
 {
-    int fd = open(DATA_FILE, O_RDONLY);
-    if (fd < 0)
-        return -1;
+    data_committed += aesd_store_append(store, iov, iovcnt);
+}
 
-    char buf[BUF_SIZE];
-    ssize_t nread;
-    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
-        ssize_t total_sent = 0;
-        while (total_sent < nread) {
-            ssize_t sent = send(client_fd, buf + total_sent, nread - total_sent, 0);
-            if (sent <= 0) {
-                close(fd);
-                return -1;
-            }
-            total_sent += sent;
+/* Append buf to the store. Caller must hold data_mutex. */
+static void append_data(const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    append_history(&iov, 1);
+}
+
+/*
+ * Group commit (-g)
+ *
+ * Lines from concurrent clients are queued as iovecs on the open batch.
+ * The first committer to find no flush in progress becomes the leader: it
+ * takes the whole batch, appends it to the store in one call (a single
+ * writev() for the file backends, which keep their descriptor open) under
+ * data_mutex, and wakes everyone whose line was in it.  Lines that arrive
+ * while a batch is being written join the next one, so under load each
+ * append carries up to COMMIT_BATCH_MAX lines.  Callers block until their
+ * own line has been written, so a replay that follows always includes it.
+ * Callers must not hold data_mutex.
+ */
+struct group_commit {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct iovec iov[COMMIT_BATCH_MAX];
+    int count;
+    uint64_t open_batch;        /* batch id that newly queued lines join */
+    uint64_t committed_batch;   /* last batch id appended to the store */
+    bool flushing;
+};
+
+static struct group_commit commit_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .open_batch = 1,
+};
+
+static void group_commit_append(const char *buf, size_t len)
+{
+    struct group_commit *gc = &commit_state;
+    struct iovec batch[COMMIT_BATCH_MAX];
+
+    pthread_mutex_lock(&gc->lock);
+    while (gc->count == COMMIT_BATCH_MAX)
+        pthread_cond_wait(&gc->cond, &gc->lock);
+
+    gc->iov[gc->count].iov_base = (void *)buf;
+    gc->iov[gc->count].iov_len = len;
+    gc->count++;
+    uint64_t my_batch = gc->open_batch;
+
+    while (gc->committed_batch < my_batch) {
+        if (gc->flushing) {
+            pthread_cond_wait(&gc->cond, &gc->lock);
+            continue;
         }
+
+        /* Lead: take the open batch and write it outside the queue lock */
+        gc->flushing = true;
+        int n = gc->count;
+        memcpy(batch, gc->iov, n * sizeof(batch[0]));
+        gc->count = 0;
+        uint64_t batch_id = gc->open_batch++;
+        pthread_cond_broadcast(&gc->cond);
+        pthread_mutex_unlock(&gc->lock);
+
+        aesd_mutex_lock(&data_mutex);
+        append_history(batch, n);
+        aesd_mutex_unlock(&data_mutex);
+
+        pthread_mutex_lock(&gc->lock);
+        gc->committed_batch = batch_id;
+        gc->flushing = false;
+        pthread_cond_broadcast(&gc->cond);
     }
-    close(fd);
-    return 0;
+    pthread_mutex_unlock(&gc->lock);
 }
 
-/* Handle a single client connection: receive data, write to file, send back */
-static void *connection_thread(void *arg)
+/*
+ * The first logical byte of [0, end) a client still needs.  A client that
+ * has already been sent everything before *replayed only gets the tail with
+ * -i; otherwise it gets the whole history, of which the store sends what it
+ * still holds.
+ */
+static off_t replay_start(off_t *replayed, off_t end)
 {
-    struct thread_entry *entry = (struct thread_entry *)arg;
-    int client_fd = entry->client_fd;
-
-    char recv_buf[BUF_SIZE];
-    char *line_buf = NULL;
-    size_t line_len = 0;
-
-    ssize_t nrecv;
-    while ((nrecv = recv(client_fd, recv_buf, sizeof(recv_buf), 0)) > 0) {
-        size_t i;
-        size_t start = 0;
-        for (i = 0; i < (size_t)nrecv; i++) {
-            if (recv_buf[i] == '\n') {
-                size_t chunk_len = i - start + 1;
-                char *tmp = realloc(line_buf, line_len + chunk_len);
-                if (!tmp) {
-                    syslog(LOG_ERR, "realloc failed");
-                    free(line_buf);
-                    line_buf = NULL;
-                    line_len = 0;
-                    goto done;
-                }
-                line_buf = tmp;
-                memcpy(line_buf + line_len, recv_buf + start, chunk_len);
-                line_len += chunk_len;
-
-                pthread_mutex_lock(&data_mutex);
-
-                /* Open fd, write, close — do not hold fd across connection */
-                int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
-                if (fd >= 0) {
-                    size_t total_written = 0;
-                    while (total_written < line_len) {
-                        ssize_t written = write(fd, line_buf + total_written, line_len - total_written);
-                        if (written < 0) {
-                            if (errno == EINTR) {
-                                continue;
-                            }
-                            syslog(LOG_ERR, "write failed: %s", strerror(errno));
-                            break;
-                        }
-                        total_written += written;
-                    }
-                    if (total_written != line_len) {
-                        syslog(LOG_ERR, "incomplete write: %zu/%zu bytes", total_written, line_len);
-                    }
-                    close(fd);
-                }
-
-                send_file_contents(client_fd);
-
-                pthread_mutex_unlock(&data_mutex);
-
-                free(line_buf);
-                line_buf = NULL;
-                line_len = 0;
-                start = i + 1;
-            }
-        }
+    off_t start = incremental_replay ? *replayed : 0;
 
-        if (start < (size_t)nrecv) {
-            size_t remaining = nrecv - start;
-            char *tmp = realloc(line_buf, line_len + remaining);
-            if (tmp) {
-                line_buf = tmp;
-                memcpy(line_buf + line_len, recv_buf + start, remaining);
-                line_len += remaining;
-            }
+    *replayed = end;
+    return start;
+}
+
+/*
+ * Record the committed history window the client still needs, capturing it
+ * from a store that cannot replay it later.  Caller holds data_mutex.
+ */
+static void snapshot_history(struct history_snapshot *snap, off_t *replayed)
+{
+    snap->end = data_committed;
+    snap->start = replay_start(replayed, snap->end);
+    snap->copy = NULL;
+    if (!aesd_store_captures(store))
+        return;
+
+    ssize_t len = aesd_store_capture(store, &snap->start, snap->end, &snap->copy);
+    if (len < 0) {
+        syslog(LOG_ERR, "capture %s: %s", store->path, strerror(errno));
+        len = 0;
+    }
+    snap->end = snap->start + len;
+}
+
+/*
+ * Append one framed line and snapshot the committed history, which includes
+ * it.  data_mutex is only held for the append itself and, where the store
+ * needs it, the capture; never for sending the reply.
+ */
+static void commit_line(const char *buf, size_t len, off_t *replayed,
+                        struct history_snapshot *snap)
+{
+    if (group_commit) {
+        group_commit_append(buf, len);
+        aesd_mutex_lock(&data_mutex);
+    } else {
+        aesd_mutex_lock(&data_mutex);
+        append_data(buf, len);
+    }
+    snapshot_history(snap, replayed);
+    aesd_mutex_unlock(&data_mutex);
+    aesd_stats_add(AESD_STAT_LINES, 1);
+}
+
+/*
+ * Send [*off, snap->end) of a snapshot, from its copy if it has one and
+ * otherwise from the store, advancing *off by what was sent.  Returns 0 or
+ * -1 with errno set, EAGAIN meaning a non-blocking socket filled up.
+ */
+static int send_snapshot(int client_fd, const struct history_snapshot *snap, off_t *off)
+{
+    if (!snap->copy)
+        return aesd_store_replay(store, client_fd, off, snap->end);
+
+    while (*off < snap->end) {
+        ssize_t sent = send(client_fd, snap->copy + (*off - snap->start),
+                            snap->end - *off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        *off += sent;
     }
+    return 0;
+}
 
-done:
-    free(line_buf);
-    close(client_fd);
-    entry->complete = true;
-    return NULL;
+/* Send a snapshot to the client and release it */
+static int send_file_contents(int client_fd, struct history_snapshot *snap)
+{
+    off_t off = snap->start;
+    int rc = send_snapshot(client_fd, snap, &off);
+
+    aesd_stats_add(AESD_STAT_BYTES_REPLAYED, off - snap->start);
+    free(snap->copy);
+    snap->copy = NULL;
+    return rc;
 }
 
-#if !USE_AESD_CHAR_DEVICE
-/* Write a timestamp to the data file every 10 seconds */
-static void *timer_thread(void *arg)
+/*
+ * Per-connection receive buffer.  Unframed bytes live in buf[head, tail).
+ * Newlines are located with memchr(), which glibc vectorizes.
+ * Framing a line just advances head, and the consumed prefix is reclaimed
+ * by sliding the remainder down only when recv() needs more room, so the
+ * buffer grows geometrically to fit the longest line seen and is never
+ * shrunk or reallocated while a connection exchanges lines that fit.
+ */
+struct rx_buffer {
+    char *buf;
+    size_t cap;
+    size_t head;        /* first byte not yet framed */
+    size_t tail;        /* one past the last received byte */
+    size_t scanned;     /* bytes after head known to hold no newline */
+};
+
+/* Make at least min_free bytes available after tail */
+static int rx_reserve(struct rx_buffer *rx, size_t min_free)
 {
-    (void)arg;
-    struct timespec ts = {10, 0};
+    if (rx->cap - rx->tail >= min_free)
+        return 0;
 
-    while (!caught_signal) {
-        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
-        if (caught_signal)
+    if (rx->head > 0) {
+        memmove(rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+        rx->tail -= rx->head;
+        rx->head = 0;
+        if (rx->cap - rx->tail >= min_free)
+            return 0;
+    }
+
+    size_t new_cap = rx->cap ? rx->cap : BUF_SIZE;
+    while (new_cap - rx->tail < min_free)
+        new_cap *= 2;
+    char *tmp = realloc(rx->buf, new_cap);
+    if (!tmp) {
+        syslog(LOG_ERR, "realloc failed");
+        return -1;
+    }
+    rx->buf = tmp;
+    rx->cap = new_cap;
+    return 0;
+}
+
+/*
+ * Frame the next newline-terminated line.  Returns a pointer to it inside
+ * the buffer, valid until the next rx_reserve(), or NULL if no complete line
+ * has been received yet.
+ */
+static char *rx_next_line(struct rx_buffer *rx, size_t *len)
+{
+    char *start = rx->buf + rx->head;
+    size_t pending = rx->tail - rx->head;
+    char *nl = NULL;
+
+    if (pending > rx->scanned)
+        nl = memchr(start + rx->scanned, '\n', pending - rx->scanned);
+    if (!nl) {
+        rx->scanned = pending;
+        return NULL;
+    }
+
+    *len = nl - start + 1;
+    rx->head += *len;
+    rx->scanned = 0;
+    if (rx->head == rx->tail)
+        rx->head = rx->tail = 0;
+    return start;
+}
+
+/* Log and count a newly accepted client */
+static void note_accept(const struct sockaddr_storage *client_addr)
+{
+    char client_ip[INET6_ADDRSTRLEN] = "local socket";
+
+    if (client_addr->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)client_addr)->sin_addr,
+                  client_ip, sizeof(client_ip));
+    else if (client_addr->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)client_addr)->sin6_addr,
+                  client_ip, sizeof(client_ip));
+    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+    aesd_stats_add(AESD_STAT_CONNECTIONS, 1);
+}
+
+/* Handle a single client connection: receive data, write to file, send back */
+static void serve_client(int client_fd)
+{
+    struct rx_buffer rx = { 0 };
+    off_t replayed = 0;
+
+    for (;;) {
+        if (rx_reserve(&rx, BUF_SIZE) < 0)
             break;
 
-        time_t now = time(NULL);
-        struct tm tm_info;
-        localtime_r(&now, &tm_info);
-        char timebuf[128];
-        strftime(timebuf, sizeof(timebuf),
-                 "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &tm_info);
-
-        pthread_mutex_lock(&data_mutex);
-        int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd >= 0) {
-            write(fd, timebuf, strlen(timebuf));
-            close(fd);
+        ssize_t nrecv = recv(client_fd, rx.buf + rx.tail, rx.cap - rx.tail, 0);
+        if (nrecv < 0 && errno == EINTR)
+            continue;
+        if (nrecv <= 0)
+            break;
+        rx.tail += nrecv;
+        aesd_stats_add(AESD_STAT_BYTES_RECEIVED, nrecv);
+
+        char *line;
+        size_t line_len;
+        while ((line = rx_next_line(&rx, &line_len)) != NULL) {
+            struct history_snapshot snap;
+            commit_line(line, line_len, &replayed, &snap);
+            uint64_t replay_began = aesd_stats_now();
+            send_file_contents(client_fd, &snap);
+            aesd_stats_replay_done(aesd_stats_now() - replay_began);
         }
-        pthread_mutex_unlock(&data_mutex);
     }
+
+    free(rx.buf);
+}
+
+static void *connection_thread(void *arg)
+{
+    struct thread_entry *entry = (struct thread_entry *)arg;
+
+    serve_client(entry->client_fd);
+
+    /* Close under the lock so a drain never shuts down a reused fd */
+    pthread_mutex_lock(&thread_list_mutex);
+    close(entry->client_fd);
+    entry->client_fd = -1;
+    entry->complete = true;
+    pthread_cond_signal(&thread_done);
+    pthread_mutex_unlock(&thread_list_mutex);
     return NULL;
 }
-#endif
 
-int main(int argc, char *argv[])
+/*
+ * Graceful drain
+ *
+ * Once SIGINT/SIGTERM has closed the listeners, every open connection is
+ * shut down for reading.  Whatever the client had already sent is still
+ * received, so each complete line is committed and answered before the
+ * worker sees EOF and exits.  Connections still open drain_timeout seconds
+ * later are shut down in both directions, which also fails a replay stuck on
+ * a client that stopped reading, so shutdown finishes within the deadline.
+ */
+
+/* drain_timeout seconds from now on clock */
+static void drain_deadline(clockid_t clock, struct timespec *deadline)
 {
-    int daemon_mode = 0;
+    clock_gettime(clock, deadline);
+    deadline->tv_sec += drain_timeout;
+}
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0)
-        daemon_mode = 1;
+/* Drain the thread-per-connection workers and join them all */
+static void drain_connection_threads(void)
+{
+    struct thread_entry *e;
+    struct timespec deadline;
+    bool forced = false;
 
-    openlog("aesdsocket", LOG_PID, LOG_USER);
+    drain_deadline(CLOCK_REALTIME, &deadline);
 
-#if !USE_AESD_CHAR_DEVICE
-    remove(DATA_FILE);
-#endif
+    pthread_mutex_lock(&thread_list_mutex);
+    SLIST_FOREACH(e, &thread_head, entries) {
+        if (e->client_fd >= 0)
+            shutdown(e->client_fd, SHUT_RD);
+    }
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    while (!SLIST_EMPTY(&thread_head)) {
+        e = SLIST_FIRST(&thread_head);
+        if (e->complete) {
+            SLIST_REMOVE_HEAD(&thread_head, entries);
+            pthread_join(e->tid, NULL);
+            free(e);
+            continue;
+        }
+        if (forced) {
+            pthread_cond_wait(&thread_done, &thread_list_mutex);
+        } else if (pthread_cond_timedwait(&thread_done, &thread_list_mutex,
+                                          &deadline) == ETIMEDOUT) {
+            struct thread_entry *open;
+            SLIST_FOREACH(open, &thread_head, entries) {
+                if (open->client_fd >= 0)
+                    shutdown(open->client_fd, SHUT_RDWR);
+            }
+            syslog(LOG_WARNING, "Drain deadline passed, closing remaining connections");
+            forced = true;
+        }
+    }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        syslog(LOG_ERR, "socket: %s", strerror(errno));
-        return -1;
+/*
+ * Timestamps (every backend but the char device)
+ *
+ * A periodic CLOCK_MONOTONIC timerfd whose first expiry is an absolute
+ * deadline; the kernel advances it by whole intervals, so servicing a tick
+ * late never shifts the ones after it.  No thread sleeps for it: the fd is
+ * polled by whichever thread already waits on behalf of the server, the
+ * accept loop in thread mode or the main thread's signal wait otherwise.
+ * The pool's accept threads are not used, as they block while the queue
+ * is full.  The io_uring engine arms its own IORING_OP_TIMEOUT instead.
+ */
+
+static int stamp_timer_fd = -1;
+
+/*
+ * strftime() output cached per minute: only the seconds change between
+ * ticks, so most lines are assembled with two memcpy() calls
+ */
+static struct {
+    time_t minute;      /* start of the minute prefix and zone describe */
+    char prefix[96];    /* "timestamp:Sat, 17 Oct 2026 00:40:" */
+    size_t prefix_len;
+    char zone[16];      /* " +0000\n" */
+    size_t zone_len;
+} stamp_cache = { .minute = -1 };
+
+/* Format the current wall-clock time as a timestamp line */
+static size_t format_timestamp(char *buf, size_t len)
+{
+    time_t now = time(NULL);
+    time_t minute = now - now % 60;
+
+    if (minute != stamp_cache.minute) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        stamp_cache.prefix_len = strftime(stamp_cache.prefix, sizeof(stamp_cache.prefix),
+                                          "timestamp:%a, %d %b %Y %H:%M:", &tm_info);
+        stamp_cache.zone_len = strftime(stamp_cache.zone, sizeof(stamp_cache.zone),
+                                        " %z\n", &tm_info);
+        stamp_cache.minute = minute;
     }
 
-    int optval = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    size_t total = stamp_cache.prefix_len + 2 + stamp_cache.zone_len;
+    if (total > len)
+        return 0;
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PORT);
+    int sec = now - minute;
+    memcpy(buf, stamp_cache.prefix, stamp_cache.prefix_len);
+    buf[stamp_cache.prefix_len] = '0' + sec / 10;
+    buf[stamp_cache.prefix_len + 1] = '0' + sec % 10;
+    memcpy(buf + stamp_cache.prefix_len + 2, stamp_cache.zone, stamp_cache.zone_len);
+    return total;
+}
 
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        syslog(LOG_ERR, "bind: %s", strerror(errno));
-        cleanup();
+static void timestamp_stop(void)
+{
+    if (stamp_timer_fd >= 0)
+        close(stamp_timer_fd);
+    stamp_timer_fd = -1;
+}
+
+static int timestamp_start(void)
+{
+    struct itimerspec its = {
+        .it_interval = { TIMESTAMP_INTERVAL, 0 },
+    };
+
+    stamp_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (stamp_timer_fd < 0) {
+        syslog(LOG_ERR, "timerfd_create: %s", strerror(errno));
         return -1;
     }
 
-    if (listen(server_fd, BACKLOG) < 0) {
-        syslog(LOG_ERR, "listen: %s", strerror(errno));
-        cleanup();
+    clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+    its.it_value.tv_sec += TIMESTAMP_INTERVAL;
+    if (timerfd_settime(stamp_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        syslog(LOG_ERR, "timerfd_settime: %s", strerror(errno));
+        timestamp_stop();
         return -1;
     }
+    return 0;
+}
 
-    if (daemon_mode) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            syslog(LOG_ERR, "fork: %s", strerror(errno));
-            cleanup();
-            return -1;
-        }
-        if (pid > 0)
-            exit(0);
-        setsid();
-        chdir("/");
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
-    }
+/* Append a timestamp if the timer has expired since the last call */
+static void timestamp_tick(void)
+{
+    uint64_t expirations;
 
-    syslog(LOG_INFO, "Listening on port %d", PORT);
+    if (read(stamp_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
 
-#if !USE_AESD_CHAR_DEVICE
-    pthread_t timer_tid;
-    pthread_create(&timer_tid, NULL, timer_thread, NULL);
-#endif
+    /* Ticks missed while the server was stalled collapse into one line */
+    char timebuf[128];
+    struct iovec iov = { .iov_base = timebuf };
+    iov.iov_len = format_timestamp(timebuf, sizeof(timebuf));
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    aesd_mutex_lock(&data_mutex);
+    append_history(&iov, 1);
+    aesd_mutex_unlock(&data_mutex);
+}
 
-        if (caught_signal) {
-            int flags = fcntl(server_fd, F_GETFL, 0);
-            fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
+/*
+ * Wait until listen_fd has a connection to accept, writing timestamps as
+ * they fall due.  Returns -1 with errno set to EINTR if a signal arrived.
+ */
+static int wait_listener(int listen_fd)
+{
+    if (stamp_timer_fd >= 0) {
+        struct pollfd pfd[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = stamp_timer_fd, .events = POLLIN },
+        };
+        for (;;) {
+            if (poll(pfd, 2, -1) < 0)
+                return -1;
+            if (pfd[1].revents)
+                timestamp_tick();
+            if (pfd[0].revents)
+                return 0;
         }
+    }
+    return 0;
+}
 
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-
-        if (client_fd < 0) {
-            if (caught_signal) {
-                if (errno == EWOULDBLOCK || errno == EAGAIN)
-                    break;
-            }
-            if (errno == EINTR)
-                continue;
-            if (errno == EWOULDBLOCK || errno == EAGAIN)
-                break;
-            syslog(LOG_ERR, "accept: %s", strerror(errno));
+/*
+ * Block until SIGINT/SIGTERM, writing timestamps as they fall due.  The
+ * caller must have those signals blocked; wait_mask is the mask to wait with.
+ */
+static void wait_for_stop(const sigset_t *wait_mask)
+{
+    while (!caught_signal) {
+        if (stamp_timer_fd >= 0) {
+            struct pollfd pfd = { .fd = stamp_timer_fd, .events = POLLIN };
+            if (ppoll(&pfd, 1, NULL, wait_mask) > 0)
+                timestamp_tick();
             continue;
         }
+        sigsuspend(wait_mask);
+    }
+}
 
-        char *client_ip = inet_ntoa(client_addr.sin_addr);
-        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+/* Hand client_fd to a new connection thread, reaping finished ones */
+static void start_connection_thread(int client_fd)
+{
+    struct thread_entry *entry = malloc(sizeof(*entry));
+    if (!entry) {
+        syslog(LOG_ERR, "malloc failed");
+        close(client_fd);
+        return;
+    }
+    entry->client_fd = client_fd;
+    entry->complete = false;
 
-        struct thread_entry *entry = malloc(sizeof(*entry));
-        if (!entry) {
-            syslog(LOG_ERR, "malloc failed");
-            close(client_fd);
-            continue;
-        }
-        entry->client_fd = client_fd;
-        entry->complete = false;
+    pthread_mutex_lock(&thread_list_mutex);
+    if (pthread_create(&entry->tid, NULL, connection_thread, entry) != 0) {
+        syslog(LOG_ERR, "pthread_create failed");
+        close(client_fd);
+        free(entry);
+    } else {
         SLIST_INSERT_HEAD(&thread_head, entry, entries);
-        pthread_create(&entry->tid, NULL, connection_thread, entry);
-
-        struct thread_entry *e = SLIST_FIRST(&thread_head);
-        while (e != NULL) {
-            struct thread_entry *next = SLIST_NEXT(e, entries);
-            if (e->complete) {
-                pthread_join(e->tid, NULL);
-                SLIST_REMOVE(&thread_head, e, thread_entry, entries);
-                free(e);
-            }
-            e = next;
+    }
+
+    struct thread_entry *e = SLIST_FIRST(&thread_head);
+    while (e != NULL) {
+        struct thread_entry *next = SLIST_NEXT(e, entries);
+        if (e->complete) {
+            pthread_join(e->tid, NULL);
+            SLIST_REMOVE(&thread_head, e, thread_entry, entries);
+            free(e);
         }
+        e = next;
     }
+    pthread_mutex_unlock(&thread_list_mutex);
+}
 
-    syslog(LOG_INFO, "Caught signal, exiting");
+/*
+ * SO_REUSEPORT listeners (-r)
+ *
+ * Every listening socket is bound to the same port and the kernel hashes
+ * each incoming connection to one of them, so connection storms are spread
+ * over several accept threads instead of serializing on one accept queue.
+ */
 
-    if (server_fd >= 0) {
-        close(server_fd);
-        server_fd = -1;
-    }
+/* Pin thread to the index-th CPU this process may run on */
+static void pin_thread(pthread_t thread, long index)
+{
+    cpu_set_t allowed, target;
+    long n = 0;
 
-#if !USE_AESD_CHAR_DEVICE
-    pthread_cancel(timer_tid);
-    pthread_join(timer_tid, NULL);
-#endif
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
 
-    while (!SLIST_EMPTY(&thread_head)) {
-        struct thread_entry *e = SLIST_FIRST(&thread_head);
-        pthread_join(e->tid, NULL);
-        SLIST_REMOVE_HEAD(&thread_head, entries);
-        free(e);
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n++ != index)
+            continue;
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+        int err = pthread_setaffinity_np(thread, sizeof(target), &target);
+        if (err != 0)
+            syslog(LOG_WARNING, "pthread_setaffinity_np: %s", strerror(err));
+        return;
     }
+}
+
+struct listener {
+    pthread_t tid;
+    int fd;
+    void (*handoff)(int client_fd);
+};
+
+static void *listener_thread(void *arg)
+{
+    struct listener *l = (struct listener *)arg;
+
+    while (!caught_signal) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(l->fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            /* shutdown() of the listener fails accept() with EINVAL */
+            if (caught_signal)
+                break;
+            if (errno != EINTR && errno != ECONNABORTED)
+                syslog(LOG_ERR, "accept: %s", strerror(errno));
+            continue;
+        }
+
+        note_accept(&client_addr);
+
+        l->handoff(client_fd);
+    }
+    return NULL;
+}
+
+/*
+ * Accept on every listening socket from its own thread until SIGINT/SIGTERM,
+ * passing each client fd to handoff.  The caller must have SIGINT/SIGTERM
+ * blocked; wait_mask is the mask to wait with.
+ */
+static int run_listeners(void (*handoff)(int client_fd), const sigset_t *wait_mask)
+{
+    long started;
+    int rc = 0;
+
+    struct listener *listeners = calloc(listener_count, sizeof(*listeners));
+    if (!listeners) {
+        syslog(LOG_ERR, "malloc failed");
+        return -1;
+    }
+
+    for (started = 0; started < listener_count; started++) {
+        struct listener *l = &listeners[started];
+        l->fd = listen_fds[started];
+        l->handoff = handoff;
+        if (pthread_create(&l->tid, NULL, listener_thread, l) != 0) {
+            syslog(LOG_ERR, "pthread_create failed");
+            rc = -1;
+            break;
+        }
+        if (pin_threads)
+            pin_thread(l->tid, started);
+    }
+
+    if (rc == 0) {
+        syslog(LOG_INFO, "Accepting on %ld listener(s)", listener_count);
+        wait_for_stop(wait_mask);
+    }
+
+    for (long i = 0; i < started; i++)
+        shutdown(listeners[i].fd, SHUT_RDWR);
+    for (long i = 0; i < started; i++)
+        pthread_join(listeners[i].tid, NULL);
+
+    free(listeners);
+    return rc;
+}
+
+/* Accept connections until a signal arrives, spawning one thread per client */
+static void accept_connection_threads(const sigset_t *wait_mask)
+{
+    if (multi_listen) {
+        if (run_listeners(start_connection_thread, wait_mask) < 0)
+            syslog(LOG_ERR, "listener threads failed to start");
+        return;
+    }
+
+    while (1) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        if (caught_signal) {
+            int flags = fcntl(server_fd, F_GETFL, 0);
+            fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
+        } else if (wait_listener(server_fd) < 0) {
+            continue;
+        }
+
+        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+
+        if (client_fd < 0) {
+            if (caught_signal) {
+                if (errno == EWOULDBLOCK || errno == EAGAIN)
+                    break;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                break;
+            syslog(LOG_ERR, "accept: %s", strerror(errno));
+            continue;
+        }
+
+        note_accept(&client_addr);
+
+        start_connection_thread(client_fd);
+    }
+}
+
+static void run_thread_per_connection(const sigset_t *wait_mask)
+{
+    accept_connection_threads(wait_mask);
+    close_listeners();
+    drain_connection_threads();
+}
+
+/*
+ * Worker pool mode
+ *
+ * Accept threads (run_listeners(), one per listening socket even without
+ * -r) hand each client fd to a bounded queue and a fixed set of workers
+ * pops and serves them with serve_client().  When every worker is busy and
+ * the queue is full the accept threads block, leaving further connections
+ * in the kernel's listen backlog, while the main thread keeps writing
+ * timestamps.
+ */
+
+struct fd_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;    /* a worker finished a connection */
+    int *fds;
+    size_t cap;
+    size_t head;            /* next slot to pop */
+    size_t count;
+    bool closed;
+    bool draining;          /* serve what is queued, then let workers exit */
+    int *active;            /* fd each worker is serving, or -1 */
+    long active_count;
+};
+
+static struct fd_queue work_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Block until there is room for fd, rechecking caught_signal periodically
+ * since a signal does not interrupt pthread_cond_wait.  Returns -1 if the
+ * server is shutting down and fd was not queued.
+ */
+static int fd_queue_push(struct fd_queue *q, int fd)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap && !caught_signal) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&q->not_full, &q->lock, &deadline);
+    }
+    if (q->count == q->cap) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    q->fds[(q->head + q->count) % q->cap] = fd;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/*
+ * Returns the next queued fd, recording it as worker's, or -1 once the
+ * queue is closed or has been drained
+ */
+static int fd_queue_pop(struct fd_queue *q, long worker)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed && !q->draining)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count > 0 && !q->closed) {
+        fd = q->fds[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        q->active[worker] = fd;
+        q->active_count++;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+/* Close worker's connection; under the lock so a drain never sees it reused */
+static void fd_queue_done(struct fd_queue *q, long worker)
+{
+    pthread_mutex_lock(&q->lock);
+    close(q->active[worker]);
+    q->active[worker] = -1;
+    q->active_count--;
+    pthread_cond_signal(&q->idle);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Shut down every queued and active connection for reading and wait until
+ * the workers have served them all, forcing the rest closed once the drain
+ * deadline passes.  The queue is closed when this returns.
+ */
+static void fd_queue_drain(struct fd_queue *q, long workers)
+{
+    struct timespec deadline;
+    int rc = 0;
+
+    drain_deadline(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&q->lock);
+    q->draining = true;
+    for (size_t i = 0; i < q->count; i++)
+        shutdown(q->fds[(q->head + i) % q->cap], SHUT_RD);
+    for (long i = 0; i < workers; i++) {
+        if (q->active[i] >= 0)
+            shutdown(q->active[i], SHUT_RD);
+    }
+    pthread_cond_broadcast(&q->not_empty);
+
+    while ((q->count > 0 || q->active_count > 0) && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&q->idle, &q->lock, &deadline);
+
+    if (q->count > 0 || q->active_count > 0) {
+        syslog(LOG_WARNING, "Drain deadline passed, closing remaining connections");
+        for (long i = 0; i < workers; i++) {
+            if (q->active[i] >= 0)
+                shutdown(q->active[i], SHUT_RDWR);
+        }
+    }
+    q->closed = true;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Wake all workers and close any connections that were never picked up */
+static void fd_queue_close(struct fd_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    while (q->count > 0) {
+        close(q->fds[q->head]);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *pool_worker(void *arg)
+{
+    long worker = (long)(intptr_t)arg;
+    int fd;
+
+    while ((fd = fd_queue_pop(&work_queue, worker)) >= 0) {
+        serve_client(fd);
+        fd_queue_done(&work_queue, worker);
+    }
+    return NULL;
+}
+
+/* Accept connections into the worker pool until a signal arrives */
+static void pool_handoff(int client_fd)
+{
+    if (fd_queue_push(&work_queue, client_fd) < 0)
+        close(client_fd);
+}
+
+static int run_worker_pool(const sigset_t *wait_mask)
+{
+    long started;
+    int rc = 0;
+
+    work_queue.cap = queue_depth;
+    work_queue.fds = calloc(work_queue.cap, sizeof(*work_queue.fds));
+    work_queue.active = calloc(worker_count, sizeof(*work_queue.active));
+    pthread_t *workers = calloc(worker_count, sizeof(*workers));
+    if (!work_queue.fds || !work_queue.active || !workers) {
+        syslog(LOG_ERR, "malloc failed");
+        free(work_queue.fds);
+        free(work_queue.active);
+        free(workers);
+        return -1;
+    }
+    for (long i = 0; i < worker_count; i++)
+        work_queue.active[i] = -1;
+
+    for (started = 0; started < worker_count; started++) {
+        if (pthread_create(&workers[started], NULL, pool_worker,
+                           (void *)(intptr_t)started) != 0) {
+            syslog(LOG_ERR, "pthread_create failed");
+            rc = -1;
+            break;
+        }
+    }
+
+    if (rc == 0) {
+        syslog(LOG_INFO, "Serving with %ld worker thread(s), queue depth %ld",
+               worker_count, queue_depth);
+        rc = run_listeners(pool_handoff, wait_mask);
+    }
+
+    close_listeners();
+    if (rc == 0)
+        fd_queue_drain(&work_queue, worker_count);
+    fd_queue_close(&work_queue);
+    for (long i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    free(work_queue.fds);
+    free(work_queue.active);
+    work_queue.fds = NULL;
+    work_queue.active = NULL;
+    return rc;
+}
+
+/*
+ * Epoll reactor mode
+ *
+ * A fixed set of reactor threads each own an epoll instance.  The listening
+ * socket is registered in every instance with EPOLLEXCLUSIVE so a new
+ * connection wakes a single reactor, which accepts it and then owns the
+ * client fd for its lifetime.  With -r, listener j is registered in reactor
+ * j % reactors and reactor i also watches listener i % listeners, so each
+ * SO_REUSEPORT socket is drained by as few reactors as possible.  Client fds
+ * are non-blocking and edge-triggered, so each wakeup drives the connection
+ * until the socket would block.
+ *
+ * Framing matches serve_client(): every newline-terminated line is
+ * committed and followed by a replay of the committed history.  The replay
+ * resumes on EPOLLOUT when the client's socket buffer fills up, and further
+ * lines from the same client are not framed until it has drained.
+ */
+
+struct conn {
+    int fd;
+    struct rx_buffer rx;
+    bool rx_eof;            /* peer has shut down its sending side */
+    bool tx_pending;        /* a committed line's replay is not fully sent */
+    struct history_snapshot tx;
+    off_t tx_off;
+    off_t replayed;         /* logical history offset already sent */
+    uint64_t tx_began;      /* when the pending replay was committed */
+    LIST_ENTRY(conn) entries;
+};
+
+struct reactor {
+    pthread_t tid;
+    int epfd;
+    LIST_HEAD(conn_list, conn) conns;
+};
+
+static int shutdown_efd = -1;
+
+/*
+ * Distinct address used as the epoll tag for the shutdown eventfd; listening
+ * sockets are tagged with their slot in listen_fds
+ */
+static char shutdown_tag;
+
+static void conn_close(struct conn *c)
+{
+    LIST_REMOVE(c, entries);
+    close(c->fd);
+    free(c->tx.copy);
+    free(c->rx.buf);
+    free(c);
+}
+
+/* Commit one framed line and start replaying the history it belongs to */
+static void conn_commit_line(struct conn *c, const char *line, size_t line_len)
+{
+    commit_line(line, line_len, &c->replayed, &c->tx);
+    c->tx_off = c->tx.start;
+    c->tx_began = aesd_stats_now();
+    c->tx_pending = true;
+}
+
+/*
+ * Continue the pending replay. Returns 1 once it is complete, 0 if the
+ * socket would block, or -1 if the connection failed.
+ */
+static int conn_flush_replay(struct conn *c)
+{
+    off_t from = c->tx_off;
+    int rc = send_snapshot(c->fd, &c->tx, &c->tx_off);
+
+    aesd_stats_add(AESD_STAT_BYTES_REPLAYED, c->tx_off - from);
+    if (rc < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+
+    aesd_stats_replay_done(aesd_stats_now() - c->tx_began);
+    free(c->tx.copy);
+    c->tx.copy = NULL;
+    c->tx_pending = false;
+    return 1;
+}
+
+/*
+ * Drive a connection as far as it can go without blocking.  Returns -1 when
+ * the connection is finished and should be closed.
+ */
+static int conn_service(struct conn *c)
+{
+    for (;;) {
+        if (c->tx_pending) {
+            int rc = conn_flush_replay(c);
+            if (rc <= 0)
+                return rc;
+        }
+
+        char *line;
+        size_t line_len;
+        if ((line = rx_next_line(&c->rx, &line_len)) != NULL) {
+            conn_commit_line(c, line, line_len);
+            continue;
+        }
+
+        if (c->rx_eof)
+            return -1;
+
+        if (rx_reserve(&c->rx, BUF_SIZE) < 0)
+            return -1;
+
+        ssize_t nrecv = recv(c->fd, c->rx.buf + c->rx.tail, c->rx.cap - c->rx.tail, 0);
+        if (nrecv > 0) {
+            c->rx.tail += nrecv;
+            aesd_stats_add(AESD_STAT_BYTES_RECEIVED, nrecv);
+        } else if (nrecv == 0) {
+            c->rx_eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Accept a bounded batch of pending connections on listen_fd into this reactor */
+static void reactor_accept(struct reactor *r, int listen_fd)
+{
+    for (int n = 0; n < MAX_EVENTS; n++) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                syslog(LOG_ERR, "accept: %s", strerror(errno));
+            return;
+        }
+
+        note_accept(&client_addr);
+
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            syslog(LOG_ERR, "malloc failed");
+            close(client_fd);
+            continue;
+        }
+        c->fd = client_fd;
+        LIST_INSERT_HEAD(&r->conns, c, entries);
+
+        /* Registering an already-writable socket delivers the first edge */
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+            conn_close(c);
+        }
+    }
+}
+
+/*
+ * Stop accepting and shut every connection down for reading, so each one
+ * closes once its buffered lines are committed and replayed
+ */
+static void reactor_drain(struct reactor *r)
+{
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, shutdown_efd, NULL);
+    for (long j = 0; j < listener_count; j++)
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, listen_fds[j], NULL);
+
+    struct conn *c = LIST_FIRST(&r->conns);
+    while (c != NULL) {
+        struct conn *next = LIST_NEXT(c, entries);
+        shutdown(c->fd, SHUT_RD);
+        if (conn_service(c) < 0)
+            conn_close(c);
+        c = next;
+    }
+}
+
+/* Milliseconds left until deadline, for epoll_wait() */
+static int reactor_timeout(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long ms = (deadline->tv_sec - now.tv_sec) * 1000LL +
+                   (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+static void *reactor_thread(void *arg)
+{
+    struct reactor *r = (struct reactor *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct timespec deadline;
+    bool stop = false, draining = false;
+
+    while (!draining || !LIST_EMPTY(&r->conns)) {
+        int timeout = draining ? reactor_timeout(&deadline) : -1;
+        if (timeout == 0) {
+            syslog(LOG_WARNING, "Drain deadline passed, closing remaining connections");
+            break;
+        }
+
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &shutdown_tag) {
+                stop = true;
+            } else if (tag >= (void *)listen_fds &&
+                       tag < (void *)(listen_fds + listener_count)) {
+                if (!draining)
+                    reactor_accept(r, *(int *)tag);
+            } else {
+                struct conn *c = (struct conn *)tag;
+                if (conn_service(c) < 0)
+                    conn_close(c);
+            }
+        }
+
+        /* After the batch, since draining closes connections it may name */
+        if (stop && !draining) {
+            draining = true;
+            drain_deadline(CLOCK_MONOTONIC, &deadline);
+            reactor_drain(r);
+        }
+    }
+
+    while (!LIST_EMPTY(&r->conns))
+        conn_close(LIST_FIRST(&r->conns));
+    return NULL;
+}
+
+/* Raise the open file limit so the reactor can hold 10k+ client sockets */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            syslog(LOG_WARNING, "setrlimit: %s", strerror(errno));
+    }
+}
+
+/*
+ * Run the reactor threads until SIGINT/SIGTERM.  The caller must have
+ * SIGINT/SIGTERM blocked in every thread; wait_mask is the mask to wait with.
+ */
+static int run_reactor(const sigset_t *wait_mask)
+{
+    struct epoll_event ev;
+    int rc = 0;
+    long started = 0;
+
+    raise_fd_limit();
+
+    for (long j = 0; j < listener_count; j++) {
+        int flags = fcntl(listen_fds[j], F_GETFL, 0);
+        fcntl(listen_fds[j], F_SETFL, flags | O_NONBLOCK);
+    }
+
+    shutdown_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shutdown_efd < 0) {
+        syslog(LOG_ERR, "eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    struct reactor *reactors = calloc(reactor_count, sizeof(*reactors));
+    if (!reactors) {
+        syslog(LOG_ERR, "malloc failed");
+        close(shutdown_efd);
+        return -1;
+    }
+
+    for (started = 0; started < reactor_count; started++) {
+        struct reactor *r = &reactors[started];
+        LIST_INIT(&r->conns);
+
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            syslog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        for (long j = 0; j < listener_count && rc == 0; j++) {
+            if (j % reactor_count != started && started % listener_count != j)
+                continue;
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &listen_fds[j];
+            if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listen_fds[j], &ev) < 0) {
+                syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+                rc = -1;
+            }
+        }
+        if (rc < 0) {
+            close(r->epfd);
+            break;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &shutdown_tag;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, shutdown_efd, &ev) < 0) {
+            syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+            close(r->epfd);
+            rc = -1;
+            break;
+        }
+
+        if (pthread_create(&r->tid, NULL, reactor_thread, r) != 0) {
+            syslog(LOG_ERR, "pthread_create failed");
+            close(r->epfd);
+            rc = -1;
+            break;
+        }
+        if (pin_threads)
+            pin_thread(r->tid, started);
+    }
+
+    if (rc == 0) {
+        syslog(LOG_INFO, "Serving with %ld epoll reactor thread(s)", reactor_count);
+        wait_for_stop(wait_mask);
+    }
+
+    /* The eventfd stays readable, so every reactor observes the shutdown */
+    uint64_t one = 1;
+    if (write(shutdown_efd, &one, sizeof(one)) < 0)
+        syslog(LOG_ERR, "eventfd write: %s", strerror(errno));
+
+    for (long i = 0; i < started; i++) {
+        pthread_join(reactors[i].tid, NULL);
+        close(reactors[i].epfd);
+    }
+
+    free(reactors);
+    close(shutdown_efd);
+    shutdown_efd = -1;
+    return rc;
+}
+
+#if USE_IO_URING
+/*
+ * io_uring mode
+ *
+ * A single thread drives one ring.  Accepts, receives, appends, replay reads
+ * and replay sends are all queued as SQEs and handed to the kernel together,
+ * so each trip through the loop costs one io_uring_enter() no matter how many
+ * connections made progress.
+ *
+ * The engine is the only writer of the history in this mode and does the
+ * file I/O itself, so it needs one of the descriptor backends (-b file or
+ * chardev).  Lines framed on any connection during a batch of completions are
+ * gathered into a single IORING_OP_WRITEV, one iovec per line, and
+ * data_committed advances when it completes.  Replays read the file into a
+ * pool of registered buffers with IORING_OP_READ_FIXED and send from them; a
+ * connection that finds the pool empty waits for the next buffer to be
+ * released.  The char device renumbers its positions whenever an append
+ * evicts an entry, so there each reply is instead read synchronously into
+ * its own heap buffer as soon as its append completes, before the next
+ * append is submitted, and sent from that.  The periodic timestamp, where
+ * the backend takes one, is an absolute IORING_OP_TIMEOUT instead of a
+ * timerfd.
+ *
+ * Each connection has at most one operation in flight and, as in the other
+ * modes, frames its next line only once the previous replay has been sent.
+ *
+ * On SIGINT/SIGTERM the accept is cancelled and every connection is shut
+ * down for reading; the loop keeps running until they have all closed or a
+ * relative IORING_OP_TIMEOUT for the drain deadline fires.
+ */
+
+#define URING_ENTRIES 1024
+#define URING_REPLAY_BUFS 64
+
+/* Operation kinds, packed into the low bits of each SQE's user_data */
+enum uring_op {
+    UOP_ACCEPT,
+    UOP_RECV,
+    UOP_APPEND,
+    UOP_READ,
+    UOP_SEND,
+    UOP_TIMEOUT,
+    UOP_CANCEL,
+    UOP_DEADLINE,
+};
+#define UOP_MASK 7ULL
+
+struct uconn {
+    int fd;
+    struct rx_buffer rx;
+    bool rx_eof;
+    bool busy;              /* an SQE for this connection is in flight */
+    __u64 busy_ud;
+    const char *line;       /* framed line waiting for or in an append */
+    size_t line_len;
+    off_t replayed;         /* logical history offset already sent */
+    off_t tx_off;
+    off_t tx_end;
+    uint64_t tx_began;
+    int buf;                /* registered replay buffer held, or -1 */
+    char *copy;             /* char device: the reply captured at commit */
+    size_t buf_len;         /* of buf or copy */
+    size_t buf_sent;
+    TAILQ_ENTRY(uconn) queue;   /* pending, committing or buffer waiters */
+    LIST_ENTRY(uconn) entries;
+};
+
+TAILQ_HEAD(uconn_queue, uconn);
+
+struct uring_engine {
+    struct aesd_uring ring;
+    unsigned inflight;
+    bool draining;          /* no new connections; waiting for open ones */
+    bool deadline_passed;
+    struct __kernel_timespec drain_timeout;
+    bool stopping;
+    int wfd;                /* O_APPEND descriptor for every append */
+    int rfd;                /* shared descriptor for replay reads */
+    LIST_HEAD(, uconn) conns;
+    struct sockaddr_storage accept_addr;
+    socklen_t accept_len;
+    /* Group append */
+    struct uconn_queue pending;
+    struct uconn_queue committing;
+    bool append_busy;
+    struct iovec append_iov[COMMIT_BATCH_MAX + 1];
+    int append_cnt;
+    /* Replay buffers */
+    char *bufs;
+    bool bufs_registered;
+    int free_bufs[URING_REPLAY_BUFS];
+    int nfree;
+    struct uconn_queue buf_waiters;
+    /* Char device: replies are captured (see uconn_capture()) */
+    bool shifting;          /* positions move as the device evicts */
+    off_t base;             /* logical offset of device position 0 */
+    /* Timestamps */
+    struct __kernel_timespec next_stamp;
+    char stamp[128];
+    size_t stamp_len;       /* non-zero while a timestamp awaits its append */
+};
+
+static struct uring_engine uring;
+
+static inline __u64 uring_ud(void *p, enum uring_op op)
+{
+    return (__u64)(uintptr_t)p | op;
+}
+
+/* Get an SQE, submitting what is queued if the ring is full */
+static struct io_uring_sqe *uring_sqe(struct uring_engine *u, void *p, enum uring_op op)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = aesd_uring_get_sqe(&u->ring)) == NULL) {
+        int ret = aesd_uring_submit(&u->ring);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(-ret));
+    }
+    sqe->user_data = uring_ud(p, op);
+    u->inflight++;
+    return sqe;
+}
+
+/* Queue an SQE on behalf of c, which must not already have one in flight */
+static struct io_uring_sqe *uconn_sqe(struct uring_engine *u, struct uconn *c,
+                                      enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, c, op);
+    c->busy = true;
+    c->busy_ud = sqe->user_data;
+    return sqe;
+}
+
+static void uconn_close(struct uconn *c)
+{
+    LIST_REMOVE(c, entries);
+    close(c->fd);
+    free(c->copy);
+    free(c->rx.buf);
+    free(c);
+}
+
+static void uring_arm_accept(struct uring_engine *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_ACCEPT);
+
+    u->accept_len = sizeof(u->accept_addr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_fd;
+    sqe->addr = (__u64)(uintptr_t)&u->accept_addr;
+    sqe->addr2 = (__u64)(uintptr_t)&u->accept_len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void uring_arm_timestamp(struct uring_engine *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_TIMEOUT);
+
+    /* Absolute deadlines keep the interval from drifting */
+    u->next_stamp.tv_sec += TIMESTAMP_INTERVAL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (__u64)(uintptr_t)&u->next_stamp;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+}
+
+/*
+ * Take the next step for a connection with nothing in flight: queue its next
+ * framed line for the group append, or receive more data.  Returns -1 once
+ * the connection is finished and has been closed.
+ */
+static int uconn_advance(struct uring_engine *u, struct uconn *c)
+{
+    if (u->stopping)
+        return 0;
+
+    c->line = rx_next_line(&c->rx, &c->line_len);
+    if (c->line) {
+        TAILQ_INSERT_TAIL(&u->pending, c, queue);
+        return 0;
+    }
+
+    if (c->rx_eof || rx_reserve(&c->rx, BUF_SIZE) < 0) {
+        uconn_close(c);
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uconn_sqe(u, c, UOP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (__u64)(uintptr_t)(c->rx.buf + c->rx.tail);
+    sqe->len = c->rx.cap - c->rx.tail;
+    return 0;
+}
+
+static int uconn_replay(struct uring_engine *u, struct uconn *c);
+static void uconn_release_buf(struct uring_engine *u, struct uconn *c);
+
+/* Read the next chunk of c's replay into the buffer it holds */
+static void uconn_read_chunk(struct uring_engine *u, struct uconn *c)
+{
+    off_t left = c->tx_end - c->tx_off;
+    struct io_uring_sqe *sqe = uconn_sqe(u, c, UOP_READ);
+
+    sqe->opcode = u->bufs_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = u->rfd;
+    sqe->addr = (__u64)(uintptr_t)(u->bufs + (size_t)c->buf * REPLAY_CHUNK);
+    sqe->len = left < REPLAY_CHUNK ? left : REPLAY_CHUNK;
+    sqe->off = c->tx_off;
+    if (u->bufs_registered)
+        sqe->buf_index = c->buf;
+}
+
+static void uconn_send_chunk(struct uring_engine *u, struct uconn *c)
+{
+    struct io_uring_sqe *sqe = uconn_sqe(u, c, UOP_SEND);
+    char *data = c->copy ? c->copy : u->bufs + (size_t)c->buf * REPLAY_CHUNK;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (__u64)(uintptr_t)(data + c->buf_sent);
+    sqe->len = c->buf_len - c->buf_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (c->tx_off + (off_t)sqe->len < c->tx_end)
+        sqe->msg_flags |= MSG_MORE;
+}
+
+/* Start or resume c's replay, waiting for a buffer if none is free */
+static int uconn_replay(struct uring_engine *u, struct uconn *c)
+{
+    if (u->stopping)
+        return 0;
+    if (c->tx_off >= c->tx_end) {
+        aesd_stats_replay_done(aesd_stats_now() - c->tx_began);
+        return uconn_advance(u, c);
+    }
+    if (c->copy) {
+        uconn_send_chunk(u, c);
+        return 0;
+    }
+
+    if (u->nfree == 0) {
+        TAILQ_INSERT_TAIL(&u->buf_waiters, c, queue);
+        return 0;
+    }
+    c->buf = u->free_bufs[--u->nfree];
+    uconn_read_chunk(u, c);
+    return 0;
+}
+
+/* Return c's replay buffer to the pool and hand it to the next waiter */
+static void uconn_release_buf(struct uring_engine *u, struct uconn *c)
+{
+    free(c->copy);
+    c->copy = NULL;
+    if (c->buf < 0)
+        return;
+    u->free_bufs[u->nfree++] = c->buf;
+    c->buf = -1;
+
+    struct uconn *w = TAILQ_FIRST(&u->buf_waiters);
+    if (w && !u->stopping) {
+        TAILQ_REMOVE(&u->buf_waiters, w, queue);
+        uconn_replay(u, w);
+    }
+}
+
+/* Submit one writev covering the timestamp and every pending line */
+static void uring_flush_appends(struct uring_engine *u)
+{
+    if (u->append_busy || u->stopping)
+        return;
+
+    u->append_cnt = 0;
+    if (u->stamp_len) {
+        u->append_iov[u->append_cnt].iov_base = u->stamp;
+        u->append_iov[u->append_cnt].iov_len = u->stamp_len;
+        u->append_cnt++;
+    }
+    while (u->append_cnt < COMMIT_BATCH_MAX && !TAILQ_EMPTY(&u->pending)) {
+        struct uconn *c = TAILQ_FIRST(&u->pending);
+        TAILQ_REMOVE(&u->pending, c, queue);
+        TAILQ_INSERT_TAIL(&u->committing, c, queue);
+        u->append_iov[u->append_cnt].iov_base = (void *)c->line;
+        u->append_iov[u->append_cnt].iov_len = c->line_len;
+        u->append_cnt++;
+    }
+    if (u->append_cnt == 0)
+        return;
+
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_APPEND);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = u->wfd;
+    sqe->addr = (__u64)(uintptr_t)u->append_iov;
+    sqe->len = u->append_cnt;
+    sqe->off = (__u64)-1;
+    u->append_busy = true;
+}
+
+/*
+ * Char device: read c's reply into a buffer of its own now, while no append
+ * is in flight to renumber the positions it maps to, skipping whatever the
+ * device has already evicted.
+ */
+static void uconn_capture(struct uring_engine *u, struct uconn *c)
+{
+    if (c->tx_off < u->base)
+        c->tx_off = u->base < c->tx_end ? u->base : c->tx_end;
+    size_t want = c->tx_end - c->tx_off;
+    c->buf_len = 0;
+    c->buf_sent = 0;
+    if (want == 0)
+        return;
+
+    c->copy = malloc(want);
+    if (!c->copy) {
+        syslog(LOG_ERR, "malloc failed");
+        c->tx_end = c->tx_off;
+        return;
+    }
+    while (c->buf_len < want) {
+        ssize_t nread = pread(u->rfd, c->copy + c->buf_len, want - c->buf_len,
+                              c->tx_off - u->base + c->buf_len);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0) {
+            if (nread < 0)
+                syslog(LOG_ERR, "read %s: %s", store->path, strerror(errno));
+            break;
+        }
+        c->buf_len += nread;
+    }
+    c->tx_end = c->tx_off + c->buf_len;
+    if (c->buf_len == 0) {
+        free(c->copy);
+        c->copy = NULL;
+    }
+}
+
+static void uring_append_done(struct uring_engine *u, int res)
+{
+    off_t committed;
+
+    if (res < 0)
+        syslog(LOG_ERR, "write %s: %s", store->path, strerror(-res));
+
+    /* Resubmit the remainder of a short write */
+    size_t done = res > 0 ? (size_t)res : 0;
+    int first = 0;
+    while (first < u->append_cnt && done >= u->append_iov[first].iov_len)
+        done -= u->append_iov[first++].iov_len;
+
+    aesd_mutex_lock(&data_mutex);
+    data_committed += res > 0 ? res : 0;
+    committed = data_committed;
+    aesd_mutex_unlock(&data_mutex);
+
+    /* No append is in flight until this one's replies are captured */
+    if (u->shifting) {
+        off_t held = lseek(u->rfd, 0, SEEK_END);
+        if (held >= 0 && held <= data_committed)
+            u->base = data_committed - held;
+    }
+
+    if (res > 0 && first < u->append_cnt && !u->stopping) {
+        u->append_iov[first].iov_base = (char *)u->append_iov[first].iov_base + done;
+        u->append_iov[first].iov_len -= done;
+        struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_APPEND);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = u->wfd;
+        sqe->addr = (__u64)(uintptr_t)(u->append_iov + first);
+        sqe->len = u->append_cnt - first;
+        sqe->off = (__u64)-1;
+        return;
+    }
+
+    u->append_busy = false;
+    u->stamp_len = 0;
+    uint64_t now = aesd_stats_now();
+    while (!TAILQ_EMPTY(&u->committing)) {
+        struct uconn *c = TAILQ_FIRST(&u->committing);
+        TAILQ_REMOVE(&u->committing, c, queue);
+        aesd_stats_add(AESD_STAT_LINES, 1);
+        c->tx_off = replay_start(&c->replayed, committed);
+        c->tx_end = committed;
+        if (u->shifting)
+            uconn_capture(u, c);
+        c->tx_began = now;
+        uconn_replay(u, c);
+    }
+}
+
+static void uring_accept_done(struct uring_engine *u, int res)
+{
+    if (res >= 0) {
+        note_accept(&u->accept_addr);
+
+        struct uconn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            syslog(LOG_ERR, "malloc failed");
+            close(res);
+        } else {
+            c->fd = res;
+            c->buf = -1;
+            LIST_INSERT_HEAD(&u->conns, c, entries);
+            /* Accepted just before the cancel took effect */
+            if (u->draining)
+                shutdown(c->fd, SHUT_RD);
+            uconn_advance(u, c);
+        }
+    } else if (res != -ECANCELED && res != -EINTR) {
+        syslog(LOG_ERR, "accept: %s", strerror(-res));
+    }
+
+    if (!u->stopping && !u->draining)
+        uring_arm_accept(u);
+}
+
+static void uconn_complete(struct uring_engine *u, struct uconn *c, enum uring_op op, int res)
+{
+    c->busy = false;
+    if (u->stopping)
+        return;
+
+    switch (op) {
+    case UOP_RECV:
+        if (res > 0) {
+            c->rx.tail += res;
+            aesd_stats_add(AESD_STAT_BYTES_RECEIVED, res);
+        } else if (res == 0 || (res != -EINTR && res != -EAGAIN))
+            c->rx_eof = true;
+        uconn_advance(u, c);
+        break;
+    case UOP_READ:
+        if (res <= 0) {
+            /* The history shrank under us or the read failed; end the replay */
+            if (res < 0)
+                syslog(LOG_ERR, "read %s: %s", store->path, strerror(-res));
+            uconn_release_buf(u, c);
+            c->tx_off = c->tx_end;
+            uconn_replay(u, c);
+            break;
+        }
+        c->buf_len = res;
+        c->buf_sent = 0;
+        uconn_send_chunk(u, c);
+        break;
+    case UOP_SEND:
+        if (res < 0) {
+            uconn_release_buf(u, c);
+            uconn_close(c);
+            break;
+        }
+        c->buf_sent += res;
+        c->tx_off += res;
+        aesd_stats_add(AESD_STAT_BYTES_REPLAYED, res);
+        if (c->buf_sent < c->buf_len) {
+            uconn_send_chunk(u, c);
+        } else if (c->tx_off < c->tx_end) {
+            uconn_read_chunk(u, c);
+        } else {
+            uconn_release_buf(u, c);
+            uconn_replay(u, c);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void uring_complete(struct uring_engine *u, __u64 user_data, int res)
+{
+    enum uring_op op = user_data & UOP_MASK;
+    void *p = (void *)(uintptr_t)(user_data & ~UOP_MASK);
+
+    u->inflight--;
+    switch (op) {
+    case UOP_ACCEPT:
+        uring_accept_done(u, res);
+        break;
+    case UOP_APPEND:
+        uring_append_done(u, res);
+        break;
+    case UOP_TIMEOUT:
+        if (res == -ETIME && !u->stopping) {
+            if (u->stamp_len == 0)
+                u->stamp_len = format_timestamp(u->stamp, sizeof(u->stamp));
+            uring_arm_timestamp(u);
+        }
+        break;
+    case UOP_DEADLINE:
+        if (res == -ETIME)
+            u->deadline_passed = true;
+        break;
+    case UOP_CANCEL:
+        break;
+    default:
+        uconn_complete(u, (struct uconn *)p, op, res);
+        break;
+    }
+}
+
+/* Handle every completion currently in the CQ ring */
+static void uring_reap(struct uring_engine *u)
+{
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = aesd_uring_peek_cqe(&u->ring)) != NULL) {
+        __u64 user_data = cqe->user_data;
+        int res = cqe->res;
+        aesd_uring_cqe_seen(&u->ring);
+        uring_complete(u, user_data, res);
+    }
+}
+
+static void uring_cancel(struct uring_engine *u, __u64 user_data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_CANCEL);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+}
+
+/*
+ * Stop accepting and shut every connection down for reading, then keep
+ * serving until each has replayed its last line and closed, or until the
+ * drain deadline passes.
+ */
+static int uring_quiesce(struct uring_engine *u)
+{
+    struct uconn *c;
+
+    u->draining = true;
+    uring_cancel(u, uring_ud(NULL, UOP_ACCEPT));
+    LIST_FOREACH(c, &u->conns, entries)
+        shutdown(c->fd, SHUT_RD);
+
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, UOP_DEADLINE);
+    u->drain_timeout.tv_sec = drain_timeout;
+    u->drain_timeout.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (__u64)(uintptr_t)&u->drain_timeout;
+    sqe->len = 1;
+
+    while (!LIST_EMPTY(&u->conns) && !u->deadline_passed) {
+        int ret = aesd_uring_submit_and_wait(&u->ring, 1, NULL);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(-ret));
+            return -1;
+        }
+        uring_reap(u);
+        uring_flush_appends(u);
+    }
+    if (u->deadline_passed)
+        syslog(LOG_WARNING, "Drain deadline passed, closing remaining connections");
+    return 0;
+}
+
+/*
+ * Cancel everything still in flight and wait for the kernel to let go of
+ * every buffer before the connections are freed.
+ */
+static void uring_drain(struct uring_engine *u)
+{
+    struct uconn *c;
+
+    u->stopping = true;
+    uring_cancel(u, uring_ud(NULL, UOP_ACCEPT));
+    uring_cancel(u, uring_ud(NULL, UOP_DEADLINE));
+    if (timestamps)
+        uring_cancel(u, uring_ud(NULL, UOP_TIMEOUT));
+    LIST_FOREACH(c, &u->conns, entries) {
+        if (c->busy)
+            uring_cancel(u, c->busy_ud);
+    }
+
+    while (u->inflight > 0) {
+        int ret = aesd_uring_submit_and_wait(&u->ring, 1, NULL);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(-ret));
+            break;
+        }
+        uring_reap(u);
+    }
+
+    while (!LIST_EMPTY(&u->conns))
+        uconn_close(LIST_FIRST(&u->conns));
+}
+
+/*
+ * Run the io_uring engine until SIGINT/SIGTERM.  The caller must have
+ * SIGINT/SIGTERM blocked; the ring waits with wait_mask installed.
+ */
+static int run_uring(const sigset_t *wait_mask)
+{
+    struct uring_engine *u = &uring;
+    int rc = 0;
+    int ret;
+
+    raise_fd_limit();
+
+    LIST_INIT(&u->conns);
+    TAILQ_INIT(&u->pending);
+    TAILQ_INIT(&u->committing);
+    TAILQ_INIT(&u->buf_waiters);
+    u->rfd = -1;
+    u->shifting = strcmp(store->name, "chardev") == 0;
+
+    u->wfd = open(store->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (u->wfd < 0) {
+        syslog(LOG_ERR, "open %s: %s", store->path, strerror(errno));
+        return -1;
+    }
+    u->rfd = open(store->path, O_RDONLY | O_CLOEXEC);
+    if (u->rfd < 0) {
+        syslog(LOG_ERR, "open %s: %s", store->path, strerror(errno));
+        close(u->wfd);
+        return -1;
+    }
+
+    ret = aesd_uring_init(&u->ring, URING_ENTRIES);
+    if (ret < 0) {
+        syslog(LOG_ERR, "io_uring_setup: %s", strerror(-ret));
+        close(u->rfd);
+        close(u->wfd);
+        return -1;
+    }
+
+    if (posix_memalign((void **)&u->bufs, sysconf(_SC_PAGESIZE),
+                       (size_t)URING_REPLAY_BUFS * REPLAY_CHUNK) != 0) {
+        syslog(LOG_ERR, "malloc failed");
+        aesd_uring_exit(&u->ring);
+        close(u->rfd);
+        close(u->wfd);
+        return -1;
+    }
+
+    struct iovec iov[URING_REPLAY_BUFS];
+    for (int i = 0; i < URING_REPLAY_BUFS; i++) {
+        iov[i].iov_base = u->bufs + (size_t)i * REPLAY_CHUNK;
+        iov[i].iov_len = REPLAY_CHUNK;
+        u->free_bufs[u->nfree++] = URING_REPLAY_BUFS - 1 - i;
+    }
+    /* Pinning can fail under a small RLIMIT_MEMLOCK; plain reads still work */
+    ret = aesd_uring_register_buffers(&u->ring, iov, URING_REPLAY_BUFS);
+    if (ret < 0)
+        syslog(LOG_WARNING, "io_uring buffer registration: %s", strerror(-ret));
+    u->bufs_registered = ret == 0;
+
+    uring_arm_accept(u);
+    if (timestamps) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        u->next_stamp.tv_sec = now.tv_sec;
+        u->next_stamp.tv_nsec = now.tv_nsec;
+        uring_arm_timestamp(u);
+    }
+
+    syslog(LOG_INFO, "Serving with io_uring (%s replay buffers)",
+           u->bufs_registered ? "registered" : "unregistered");
+
+    while (!caught_signal) {
+        ret = aesd_uring_submit_and_wait(&u->ring, 1, wait_mask);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter: %s", strerror(-ret));
+            rc = -1;
+            break;
+        }
+        uring_reap(u);
+        uring_flush_appends(u);
+    }
+
+    if (rc == 0 && uring_quiesce(u) < 0)
+        rc = -1;
+    uring_drain(u);
+    aesd_uring_exit(&u->ring);
+    free(u->bufs);
+    u->bufs = NULL;
+    close(u->rfd);
+    close(u->wfd);
+    return rc;
+}
+#endif
+
+/*
+ * Stats socket (-s)
+ *
+ * A local stream socket that answers each connection with the counters
+ * from aesd-stats.c and closes it, e.g. "nc -U /tmp/aesdsocket.stats".  It
+ * is served from its own thread so it stays responsive in every mode.
+ */
+
+static int stats_fd = -1;
+static pthread_t stats_tid;
+
+static void *stats_thread(void *arg)
+{
+    char report[4096];
+
+    (void)arg;
+    for (;;) {
+        int fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* stop_stats_socket() shut the socket down */
+            break;
+        }
+
+        size_t len = aesd_stats_format(report, sizeof(report));
+        for (size_t off = 0; off < len;) {
+            ssize_t n = send(fd, report + off, len - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            off += n;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_stats_socket(void)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(stats_path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "stats socket path too long: %s", stats_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, stats_path);
+
+    stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_fd < 0) {
+        syslog(LOG_ERR, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    /* A stale socket from an earlier run would make bind() fail */
+    unlink(stats_path);
+    if (bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(stats_fd, BACKLOG) < 0) {
+        syslog(LOG_ERR, "stats socket %s: %s", stats_path, strerror(errno));
+        close(stats_fd);
+        stats_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&stats_tid, NULL, stats_thread, NULL) != 0) {
+        syslog(LOG_ERR, "pthread_create failed");
+        close(stats_fd);
+        stats_fd = -1;
+        unlink(stats_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_stats_socket(void)
+{
+    if (stats_fd < 0)
+        return;
+
+    /* Wakes the blocked accept() with EINVAL */
+    shutdown(stats_fd, SHUT_RDWR);
+    pthread_join(stats_tid, NULL);
+    close(stats_fd);
+    stats_fd = -1;
+    unlink(stats_path);
+}
+
+/*
+ * Create a socket listening as spec says: on PORT for TCP, at spec->path for
+ * a local socket.  With -r every TCP listener sets SO_REUSEPORT so they can
+ * all bind the same port.
+ */
+static int open_listener(const struct listen_spec *spec, int backlog)
+{
+    static const int families[] = {
+        [LISTEN_TCP] = AF_INET,
+        [LISTEN_TCP6] = AF_INET6,
+        [LISTEN_UNIX] = AF_UNIX,
+    };
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    memset(&addr, 0, sizeof(addr));
+    if (spec->kind == LISTEN_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(spec->path) >= sizeof(un->sun_path)) {
+            syslog(LOG_ERR, "socket path too long: %s", spec->path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec->path);
+        addr_len = sizeof(*un);
+    } else if (spec->kind == LISTEN_TCP6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(PORT);
+        addr_len = sizeof(*in6);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = INADDR_ANY;
+        in->sin_port = htons(PORT);
+        addr_len = sizeof(*in);
+    }
+
+    int fd = socket(families[spec->kind], SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int optval = 1;
+    if (spec->kind == LISTEN_UNIX) {
+        /* A stale socket from an earlier run would make bind() fail */
+        unlink(spec->path);
+    } else {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        if (reuseport &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+            syslog(LOG_ERR, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        /*
+         * Accepted sockets inherit these.  Replays mark every send but their
+         * last with MSG_MORE, so Nagle would only hold back each reply's final
+         * short segment until the previous one is acknowledged.
+         */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+    if (spec->kind == LISTEN_TCP6) {
+        /* Dual-stack, unless an IPv4 listener already holds the port */
+        int v6only = 0;
+        for (int i = 0; i < listen_spec_count; i++) {
+            if (listen_specs[i].kind == LISTEN_TCP)
+                v6only = 1;
+        }
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    if (send_buffer &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer)) < 0)
+        syslog(LOG_WARNING, "setsockopt SO_SNDBUF: %s", strerror(errno));
+    if (receive_buffer &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer)) < 0)
+        syslog(LOG_WARNING, "setsockopt SO_RCVBUF: %s", strerror(errno));
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        syslog(LOG_ERR, "bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, backlog) < 0) {
+        syslog(LOG_ERR, "listen: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Parse a -l argument into the next listen_specs slot */
+static int add_listen_spec(const char *arg)
+{
+    if (listen_spec_count == MAX_LISTEN_SPECS)
+        return -1;
+
+    struct listen_spec *spec = &listen_specs[listen_spec_count];
+    if (strcmp(arg, "tcp") == 0) {
+        spec->kind = LISTEN_TCP;
+    } else if (strcmp(arg, "tcp6") == 0) {
+        spec->kind = LISTEN_TCP6;
+    } else if (strncmp(arg, "unix:", 5) == 0 && arg[5] != '\0') {
+        spec->kind = LISTEN_UNIX;
+        spec->path = arg + 5;
+    } else {
+        return -1;
+    }
+
+    listen_spec_count++;
+    return 0;
+}
+
+/* Socket buffer size for -S/-R, or 0 if arg is not a positive int */
+static int parse_buffer_size(const char *arg)
+{
+    long bytes = strtol(arg, NULL, 10);
+
+    return bytes > 0 && bytes <= INT_MAX ? (int)bytes : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d] [-g] [-i] [-m thread|pool|epoll" URING_MODE_NAME "] [-t threads]\n"
+            "          [-w workers] [-q depth] [-r count] [-P] [-s path] [-D seconds]\n"
+            "          [-b chardev|file|mmap|ring] [-c lines] [-S bytes] [-R bytes]\n"
+            "          [-l tcp|tcp6|unix:path]...\n"
+            "  -d          run as a daemon\n"
+            "  -g          keep one append descriptor open and group-commit lines\n"
+            "              from concurrent clients into batched writev() calls\n"
+            "              (not with -m epoll)\n"
+            "  -i          incremental replay: after the first line, send each client\n"
+            "              only the history it has not been sent yet\n"
+            "  -m mode     connection handling: thread per connection (default),\n"
+            "              fixed worker pool, or edge-triggered epoll reactor\n"
+#if USE_IO_URING
+            "              (uring: one thread batching all I/O through io_uring)\n"
+#endif
+            "  -t threads  reactor threads for -m epoll (default: online CPUs)\n"
+            "  -w workers  worker threads for -m pool (default: online CPUs)\n"
+            "  -q depth    accepted connections queued for -m pool (default: %d)\n"
+            "  -r count    open count SO_REUSEPORT sockets per TCP listener, each with\n"
+            "              its own accept thread (-m epoll: spread over the reactors)\n"
+            "  -P          pin accept threads and reactors to separate CPUs\n"
+            "  -s path     serve runtime counters on a local socket at path\n"
+            "  -D seconds  on SIGINT/SIGTERM, give open connections this long to\n"
+            "              finish before closing them (default: %d)\n"
+            "  -b backend  where the history lives: the aesdchar device, a data\n"
+            "              file, the data file kept mapped, or an in-memory ring\n"
+            "              (default: %s)\n"
+            "  -c lines    keep the newest lines in memory and replay them from\n"
+            "              there with one sendmsg() instead of the backend\n"
+            "  -S bytes    SO_SNDBUF for client connections (default: kernel)\n"
+            "  -R bytes    SO_RCVBUF for client connections (default: kernel)\n"
+            "  -l listener listen on IPv4 TCP port %d (default), dual-stack IPv6\n"
+            "              TCP port %d, or a local stream socket at path; repeat\n"
+            "              for several listeners, which then get an accept thread each\n",
+            prog, DEFAULT_QUEUE_DEPTH, DEFAULT_DRAIN_TIMEOUT, DEFAULT_BACKEND, PORT, PORT);
+}
+
+int main(int argc, char *argv[])
+{
+    int daemon_mode = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dgim:t:w:q:r:Ps:D:b:c:S:R:l:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'g':
+            group_commit = true;
+            break;
+        case 'i':
+            incremental_replay = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0) {
+                server_mode = MODE_THREAD;
+            } else if (strcmp(optarg, "pool") == 0) {
+                server_mode = MODE_POOL;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                server_mode = MODE_EPOLL;
+#if USE_IO_URING
+            } else if (strcmp(optarg, "uring") == 0) {
+                server_mode = MODE_URING;
+#endif
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't':
+            reactor_count = strtol(optarg, NULL, 10);
+            if (reactor_count <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'w':
+            worker_count = strtol(optarg, NULL, 10);
+            if (worker_count <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q':
+            queue_depth = strtol(optarg, NULL, 10);
+            if (queue_depth <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            reuseport_count = strtol(optarg, NULL, 10);
+            if (reuseport_count <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            reuseport = true;
+            break;
+        case 'l':
+            if (add_listen_spec(optarg) < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'P':
+            pin_threads = true;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'D':
+            drain_timeout = strtol(optarg, NULL, 10);
+            if (drain_timeout < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'c':
+            cache_lines = strtol(optarg, NULL, 10);
+            if (cache_lines <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'S':
+            send_buffer = parse_buffer_size(optarg);
+            if (send_buffer <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'R':
+            receive_buffer = parse_buffer_size(optarg);
+            if (receive_buffer <= 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (listen_spec_count == 0)
+        add_listen_spec("tcp");
+    listener_count = 0;
+    for (int i = 0; i < listen_spec_count; i++)
+        listener_count += listen_specs[i].kind == LISTEN_UNIX ? 1 : reuseport_count;
+    multi_listen = reuseport || listener_count > 1;
+
+    /*
+     * The io_uring engine accepts on one socket from its single thread and
+     * does its own appends and replay reads on the ring, so it needs a
+     * descriptor backend and would leave a cache in front of it stale
+     */
+    if (server_mode == MODE_URING && (multi_listen || cache_lines ||
+        (strcmp(backend, "file") != 0 && strcmp(backend, "chardev") != 0))) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    /*
+     * A group committer sleeps until its batch is written, which would stall
+     * every connection on the reactor thread that made it wait
+     */
+    if (server_mode == MODE_EPOLL && group_commit) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus <= 0)
+        online_cpus = 1;
+    if (reactor_count == 0)
+        reactor_count = online_cpus;
+    if (worker_count == 0)
+        worker_count = online_cpus;
+
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+
+    struct aesd_store_config store_config = {
+        .path = strcmp(backend, "chardev") == 0 ? CHAR_DEVICE : DATA_FILE,
+        .keep_open = group_commit,
+        .map_reserve = MAP_RESERVE,
+        .ring_size = RING_SIZE,
+    };
+    store = aesd_store_open(backend, &store_config);
+    if (!store) {
+        if (errno == EINVAL)
+            usage(argv[0]);
+        else
+            syslog(LOG_ERR, "opening %s history: %s", backend, strerror(errno));
+        closelog();
+        return -1;
+    }
+
+    if (cache_lines) {
+        struct aesd_store *cached = aesd_cache_open(store, cache_lines);
+        if (cached)
+            store = cached;
+        else
+            syslog(LOG_WARNING, "History cache disabled: %s", strerror(errno));
+    }
+
+    /* The char device keeps history across runs; start from its length */
+    data_committed = aesd_store_length(store);
+
+    /* The driver stores only what clients send */
+    timestamps = strcmp(store->name, "chardev") != 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* sendfile()/splice() cannot take MSG_NOSIGNAL; report EPIPE instead */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    bool event_driven = server_mode == MODE_EPOLL || server_mode == MODE_URING;
+    int backlog = event_driven || multi_listen ? SOMAXCONN : BACKLOG;
+
+    listen_fds = malloc(listener_count * sizeof(*listen_fds));
+    if (!listen_fds) {
+        syslog(LOG_ERR, "malloc failed");
+        cleanup();
+        return -1;
+    }
+    for (long i = 0; i < listener_count; i++)
+        listen_fds[i] = -1;
+    long opened = 0;
+    for (int i = 0; i < listen_spec_count; i++) {
+        const struct listen_spec *spec = &listen_specs[i];
+        long count = spec->kind == LISTEN_UNIX ? 1 : reuseport_count;
+        for (long j = 0; j < count; j++) {
+            listen_fds[opened] = open_listener(spec, backlog);
+            if (listen_fds[opened++] < 0) {
+                cleanup();
+                return -1;
+            }
+        }
+    }
+    server_fd = listen_fds[0];
+
+    if (daemon_mode) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            syslog(LOG_ERR, "fork: %s", strerror(errno));
+            cleanup();
+            return -1;
+        }
+        if (pid > 0)
+            exit(0);
+        setsid();
+        chdir("/");
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+    }
+
+    syslog(LOG_INFO, "Listening on port %d", PORT);
+
+    /*
+     * Behind the reactor, the pool or accept threads the main thread waits
+     * for signals in sigsuspend() or ppoll(), and the io_uring engine in
+     * io_uring_enter(), so every other thread must inherit a mask that keeps
+     * SIGINT/SIGTERM away from them.
+     */
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (event_driven || multi_listen || server_mode == MODE_POOL)
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+    /* The io_uring engine schedules timestamps on its own ring */
+    if (timestamps && server_mode != MODE_URING && timestamp_start() < 0)
+        syslog(LOG_WARNING, "Timestamps disabled");
+
+    if (stats_path) {
+        /* Keep stop signals on the threads that wait for them */
+        sigset_t old_mask;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+        if (start_stats_socket() < 0)
+            syslog(LOG_WARNING, "Stats socket disabled");
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+    switch (server_mode) {
+#if USE_IO_URING
+    case MODE_URING:
+        if (run_uring(&wait_mask) < 0)
+            syslog(LOG_ERR, "io_uring engine failed to start");
+        break;
+#endif
+    case MODE_EPOLL:
+        if (run_reactor(&wait_mask) < 0)
+            syslog(LOG_ERR, "epoll reactor failed to start");
+        break;
+    case MODE_POOL:
+        if (run_worker_pool(&wait_mask) < 0)
+            syslog(LOG_ERR, "worker pool failed to start");
+        break;
+    default:
+        run_thread_per_connection(&wait_mask);
+        break;
+    }
+
+    syslog(LOG_INFO, "Caught signal, exiting");
+
+    stop_stats_socket();
+
+    close_listeners();
+
+    timestamp_stop();
 
-    pthread_mutex_destroy(&data_mutex);
+    aesd_mutex_destroy(&data_mutex);
     cleanup();
     return 0;
 }
@@ -0,0 +1,102 @@
+/**
+ * scan-bench.c - Micro-benchmark for the aesd-scan newline scanners.
+ *
+ * Frames a buffer of fixed-length lines the way rx_next_line() does, once
+ * per scanner the CPU supports, and reports throughput in bytes per cycle
+ * (TSC cycles on x86, nanoseconds elsewhere).
+ *
+ * Usage: scan-bench [buffer-MiB] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CLOCK_UNIT "cycle"
+static inline unsigned long long bench_clock(void)
+{
+    return __rdtsc();
+}
+#else
+#define CLOCK_UNIT "ns"
+static inline unsigned long long bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Walk every line in buf with scan, returning the number of lines found */
+static size_t frame_all(aesd_scan_fn scan, const char *buf, size_t len)
+{
+    size_t lines = 0;
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+
+    while (p < end && (nl = scan(p, end - p)) != NULL) {
+        lines++;
+        p = nl + 1;
+    }
+    return lines;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t line_lengths[] = { 16, 64, 256, 1024, 16384, 1 << 20 };
+    size_t len = (argc > 1 ? strtoul(argv[1], NULL, 10) : 4) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    char *buf = malloc(len);
+
+    if (!buf || len == 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [buffer-MiB] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s", "line len");
+    for (const struct aesd_scan_impl *impl = aesd_scan_impls; impl->name; impl++) {
+        if (impl->supported())
+            printf(" %14s", impl->name);
+    }
+    printf("   (bytes/%s)\n", CLOCK_UNIT);
+
+    for (size_t l = 0; l < sizeof(line_lengths) / sizeof(line_lengths[0]); l++) {
+        size_t line_len = line_lengths[l];
+
+        memset(buf, 'a', len);
+        for (size_t i = line_len - 1; i < len; i += line_len)
+            buf[i] = '\n';
+
+        printf("%-10zu", line_len);
+        for (const struct aesd_scan_impl *impl = aesd_scan_impls; impl->name; impl++) {
+            if (!impl->supported())
+                continue;
+
+            size_t expected = len / line_len;
+            unsigned long long best = ~0ULL;
+            for (int r = 0; r < rounds; r++) {
+                unsigned long long start = bench_clock();
+                size_t lines = frame_all(impl->scan, buf, len);
+                unsigned long long elapsed = bench_clock() - start;
+                if (lines != expected) {
+                    fprintf(stderr, "%s found %zu lines, expected %zu\n",
+                            impl->name, lines, expected);
+                    return 1;
+                }
+                if (elapsed < best)
+                    best = elapsed;
+            }
+            printf(" %14.2f", (double)len / (double)(best ? best : 1));
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,293 @@
+/**
+ * @file aesdchar-shim.c
+ * @brief LD_PRELOAD stand-in for /dev/aesdchar
+ *
+ * Lets aesdsocket's chardev backend run on a machine without the driver.
+ * Opening /dev/aesdchar returns a descriptor for /dev/null, and every write,
+ * read and seek on it is served from a circular buffer built from the
+ * driver's own aesd-circular-buffer.c, with aesd_write()'s newline commit
+ * and eviction and aesd_read()'s multi-entry reads.  sendfile() and splice()
+ * fail with EINVAL, as they do on the real device.
+ *
+ * AESDCHAR_SHIM_DELAY_US, if set, sleeps that long before every read takes
+ * the device lock, which widens any window in which a caller uses a device
+ * position worked out before a concurrent append.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define SHIM_PATH "/dev/aesdchar"
+#define SHIM_MAX_FD 1024
+
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_circular_buffer dev_buffer;
+static char *partial_buf;
+static size_t partial_len;
+static bool dev_ready;
+static bool is_dev[SHIM_MAX_FD];
+static off_t dev_pos[SHIM_MAX_FD];
+static unsigned read_delay_us;
+
+#define REAL(ret, name, ...) \
+    static ret (*real_##name)(__VA_ARGS__); \
+    if (!real_##name) \
+        real_##name = (ret (*)(__VA_ARGS__))dlsym(RTLD_NEXT, #name)
+
+static bool shim_fd(int fd)
+{
+    return fd >= 0 && fd < SHIM_MAX_FD && __atomic_load_n(&is_dev[fd], __ATOMIC_ACQUIRE);
+}
+
+/* Open /dev/null in place of the device and remember the descriptor */
+static int shim_open(int flags)
+{
+    REAL(int, open, const char *, int, ...);
+    int fd = real_open("/dev/null", (flags & (O_ACCMODE | O_CLOEXEC)));
+
+    if (fd < 0)
+        return fd;
+    if (fd >= SHIM_MAX_FD) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    pthread_mutex_lock(&dev_lock);
+    if (!dev_ready) {
+        const char *delay = getenv("AESDCHAR_SHIM_DELAY_US");
+        aesd_circular_buffer_init(&dev_buffer);
+        read_delay_us = delay ? (unsigned)atoi(delay) : 0;
+        dev_ready = true;
+    }
+    dev_pos[fd] = 0;
+    pthread_mutex_unlock(&dev_lock);
+    __atomic_store_n(&is_dev[fd], true, __ATOMIC_RELEASE);
+    return fd;
+}
+
+/* aesd_write(): accumulate, and commit on a trailing newline */
+static ssize_t shim_write(const void *buf, size_t count)
+{
+    pthread_mutex_lock(&dev_lock);
+    char *grown = realloc(partial_buf, partial_len + count);
+    if (!grown) {
+        pthread_mutex_unlock(&dev_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    partial_buf = grown;
+    memcpy(partial_buf + partial_len, buf, count);
+    partial_len += count;
+
+    if (partial_len > 0 && partial_buf[partial_len - 1] == '\n') {
+        struct aesd_buffer_entry entry = { partial_buf, partial_len };
+
+        if (dev_buffer.full)
+            free((void *)dev_buffer.entry[dev_buffer.out_offs].buffptr);
+        aesd_circular_buffer_add_entry(&dev_buffer, &entry);
+        partial_buf = NULL;
+        partial_len = 0;
+    }
+    pthread_mutex_unlock(&dev_lock);
+    return count;
+}
+
+/* aesd_read(): copy across consecutive entries from pos */
+static ssize_t shim_read(void *buf, size_t count, off_t pos)
+{
+    size_t copied = 0;
+
+    if (read_delay_us)
+        usleep(read_delay_us);
+
+    pthread_mutex_lock(&dev_lock);
+    while (copied < count) {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&dev_buffer, pos + copied,
+                                                            &entry_offset);
+        if (!entry)
+            break;
+        size_t n = entry->size - entry_offset;
+        if (n > count - copied)
+            n = count - copied;
+        memcpy((char *)buf + copied, entry->buffptr + entry_offset, n);
+        copied += n;
+    }
+    pthread_mutex_unlock(&dev_lock);
+    return copied;
+}
+
+static int open_common(const char *path, int flags, mode_t mode, bool at, int dirfd)
+{
+    if (strcmp(path, SHIM_PATH) == 0)
+        return shim_open(flags);
+    if (at) {
+        REAL(int, openat, int, const char *, int, ...);
+        return real_openat(dirfd, path, flags, mode);
+    }
+    REAL(int, open, const char *, int, ...);
+    return real_open(path, flags, mode);
+}
+
+static mode_t open_mode(int flags, va_list ap)
+{
+    return (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return open_common(path, flags, mode, false, AT_FDCWD);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return open_common(path, flags, mode, false, AT_FDCWD);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return open_common(path, flags, mode, true, dirfd);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return open_common(path, flags, mode, true, dirfd);
+}
+
+int close(int fd)
+{
+    REAL(int, close, int);
+    if (shim_fd(fd))
+        __atomic_store_n(&is_dev[fd], false, __ATOMIC_RELEASE);
+    return real_close(fd);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    REAL(ssize_t, write, int, const void *, size_t);
+    if (shim_fd(fd))
+        return shim_write(buf, count);
+    return real_write(fd, buf, count);
+}
+
+/* The driver has no write_iter, so the kernel calls write() per iovec */
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    REAL(ssize_t, writev, int, const struct iovec *, int);
+    if (!shim_fd(fd))
+        return real_writev(fd, iov, iovcnt);
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t n = shim_write(iov[i].iov_base, iov[i].iov_len);
+        if (n < 0)
+            return total ? total : n;
+        total += n;
+    }
+    return total;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    REAL(ssize_t, read, int, void *, size_t);
+    if (!shim_fd(fd))
+        return real_read(fd, buf, count);
+
+    ssize_t n = shim_read(buf, count, dev_pos[fd]);
+    dev_pos[fd] += n;
+    return n;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    REAL(ssize_t, pread, int, void *, size_t, off_t);
+    if (shim_fd(fd))
+        return shim_read(buf, count, offset);
+    return real_pread(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off_t offset)
+{
+    return pread(fd, buf, count, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    REAL(off_t, lseek, int, off_t, int);
+    if (!shim_fd(fd))
+        return real_lseek(fd, offset, whence);
+
+    pthread_mutex_lock(&dev_lock);
+    off_t size = aesd_circular_buffer_total_size(&dev_buffer);
+    off_t pos = whence == SEEK_SET ? offset :
+                whence == SEEK_CUR ? dev_pos[fd] + offset :
+                whence == SEEK_END ? size + offset : -1;
+    pthread_mutex_unlock(&dev_lock);
+    if (pos < 0 || pos > size) {
+        errno = EINVAL;
+        return -1;
+    }
+    dev_pos[fd] = pos;
+    return pos;
+}
+
+off_t lseek64(int fd, off_t offset, int whence)
+{
+    return lseek(fd, offset, whence);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    REAL(ssize_t, sendfile, int, int, off_t *, size_t);
+    if (shim_fd(in_fd)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return real_sendfile(out_fd, in_fd, offset, count);
+}
+
+ssize_t sendfile64(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    return sendfile(out_fd, in_fd, offset, count);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+               unsigned int flags)
+{
+    REAL(ssize_t, splice, int, loff_t *, int, loff_t *, size_t, unsigned int);
+    if (shim_fd(fd_in) || shim_fd(fd_out)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+}
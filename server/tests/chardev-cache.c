@@ -0,0 +1,181 @@
+/**
+ * @file chardev-cache.c
+ * @brief Check that -c never changes what aesdsocket's chardev replies hold
+ *
+ * Starts aesdsocket with aesdchar-shim.so preloaded, once without a cache
+ * and then with a cache smaller and larger than the emulated device's ten
+ * entries.  Each run sends more lines than the device holds on one
+ * connection, reading the reply to each before sending the next.
+ *
+ * Without a cache every reply is what the device still holds, so the last
+ * ones must be exactly its ten newest lines.  With either cache, every reply
+ * must match the uncached run's byte for byte: a cache that kept lines the
+ * device had evicted would replay more of the history than the device does.
+ *
+ * Usage: chardev-cache shim.so aesdsocket [aesdsocket options...]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PORT 9000
+#define LINES 25
+#define LINE_LEN 32
+#define DEVICE_ENTRIES 10       /* aesdchar-shim.so, like the driver by default */
+#define REPLY_CAP (LINES * LINE_LEN)
+#define REPLY_TIMEOUT_MS 5000
+#define MAX_ARGS 32
+
+static const char *cache_args[] = { NULL, "3", "100" };
+#define RUNS (sizeof(cache_args) / sizeof(cache_args[0]))
+
+static char replies[RUNS][LINES][REPLY_CAP];
+static ssize_t reply_len[RUNS][LINES];
+
+static void format_line(char *buf, int seq)
+{
+    int n = snprintf(buf, LINE_LEN, "line %06d ", seq);
+    memset(buf + n, 'a' + seq % 26, LINE_LEN - 1 - n);
+    buf[LINE_LEN - 1] = '\n';
+}
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(PORT) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read until the reply ends with the line just sent, or time out */
+static ssize_t read_reply(int fd, char *buf, size_t cap, const char *own)
+{
+    size_t len = 0;
+
+    while (len < LINE_LEN || memcmp(buf + len - LINE_LEN, own, LINE_LEN) != 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (len == cap || poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+            return -1;
+        ssize_t n = recv(fd, buf + len, cap - len, 0);
+        if (n <= 0)
+            return -1;
+        len += n;
+    }
+    return len;
+}
+
+/* Start the server with the shim and -c lines (none if NULL), and record every reply */
+static int run_server(char *argv[], int argc, const char *lines, size_t run)
+{
+    char *args[MAX_ARGS];
+    int n = 0;
+
+    for (int i = 2; i < argc && n < MAX_ARGS - 3; i++)
+        args[n++] = argv[i];
+    if (lines) {
+        args[n++] = "-c";
+        args[n++] = (char *)lines;
+    }
+    args[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", argv[1], 1);
+        execv(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    }
+
+    /* Wait for the listener */
+    int fd = -1;
+    for (int i = 0; i < 100 && fd < 0; i++) {
+        fd = connect_server();
+        if (fd < 0)
+            usleep(50000);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "FAIL: server did not start listening\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    int rc = 0;
+    char line[LINE_LEN];
+    for (int seq = 0; seq < LINES; seq++) {
+        format_line(line, seq);
+        if (send(fd, line, LINE_LEN, MSG_NOSIGNAL) != LINE_LEN) {
+            fprintf(stderr, "FAIL: send: %s\n", strerror(errno));
+            rc = -1;
+            break;
+        }
+        reply_len[run][seq] = read_reply(fd, replies[run][seq], REPLY_CAP, line);
+        if (reply_len[run][seq] < 0) {
+            fprintf(stderr, "FAIL: -c %s: reply %d does not end with the line sent\n",
+                    lines ? lines : "none", seq);
+            rc = -1;
+            break;
+        }
+    }
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s shim.so aesdsocket [options...]\n", argv[0]);
+        return 2;
+    }
+
+    for (size_t run = 0; run < RUNS && !failures; run++) {
+        if (run_server(argv, argc, cache_args[run], run) < 0)
+            failures++;
+    }
+
+    if (!failures && reply_len[0][LINES - 1] != DEVICE_ENTRIES * LINE_LEN) {
+        fprintf(stderr, "FAIL: uncached reply holds %zd lines, not the device's %d\n",
+                reply_len[0][LINES - 1] / LINE_LEN, DEVICE_ENTRIES);
+        failures++;
+    }
+
+    for (size_t run = 1; run < RUNS && !failures; run++) {
+        for (int seq = 0; seq < LINES; seq++) {
+            if (reply_len[run][seq] != reply_len[0][seq] ||
+                memcmp(replies[run][seq], replies[0][seq], reply_len[0][seq]) != 0) {
+                fprintf(stderr, "FAIL: -c %s: reply %d holds %zd lines, uncached %zd\n",
+                        cache_args[run], seq, reply_len[run][seq] / LINE_LEN,
+                        reply_len[0][seq] / LINE_LEN);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    printf("%s: cache matches device:", failures ? "FAIL" : "PASS");
+    for (int i = 2; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf("\n");
+    return failures ? 1 : 0;
+}
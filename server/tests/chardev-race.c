@@ -0,0 +1,277 @@
+/**
+ * @file chardev-race.c
+ * @brief Concurrent-writer replay check for aesdsocket's chardev backend
+ *
+ * Starts aesdsocket with aesdchar-shim.so preloaded, so -b chardev runs
+ * against an emulated /dev/aesdchar that evicts its oldest entry on every
+ * write once it holds ten.  Several clients then commit numbered lines at
+ * once, each reading its replay before sending the next line.
+ *
+ * Every replay must be a contiguous run of the history: whole lines, ending
+ * with the line that triggered it.  Across all replays no line may ever be
+ * followed by two different lines.  A reader that uses device positions
+ * from before a concurrent eviction sees a line cut off at the front or
+ * another client's later line, and fails one of those checks; one that
+ * reads the device only after other clients have evicted its own line
+ * never sees the line and times out.
+ *
+ * With -i (pass it through to the server) a reply is only the tail the
+ * client has not seen, and one that fell behind by more than the device
+ * holds legitimately skips ahead.  So once every client is done, the
+ * history is rebuilt from the successor links, and each client's lines must
+ * move strictly forward through it: a tail that repeats bytes or goes back
+ * fails.
+ *
+ * Usage: chardev-race shim.so aesdsocket [aesdsocket options...]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PORT 9000
+#define WRITERS 4
+#define LINES 400
+#define LINE_LEN 48
+#define REPLY_TIMEOUT_MS 5000
+
+static bool incremental;
+static pthread_mutex_t succ_lock = PTHREAD_MUTEX_INITIALIZER;
+static int succ[WRITERS * LINES];  /* line id -> id of the line after it, or -1 */
+static int failures;
+static int received[WRITERS][LINES * WRITERS];  /* -i: ids each client was sent */
+static int received_count[WRITERS];
+
+static void fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&succ_lock);
+    if (failures++ < 10) {
+        va_start(ap, fmt);
+        fputs("FAIL: ", stderr);
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+        va_end(ap);
+    }
+    pthread_mutex_unlock(&succ_lock);
+}
+
+static void format_line(char *buf, int writer, int seq)
+{
+    int n = snprintf(buf, LINE_LEN, "w%d %06d ", writer, seq);
+    memset(buf + n, 'a' + writer, LINE_LEN - 1 - n);
+    buf[LINE_LEN - 1] = '\n';
+}
+
+/* Line id for a well-formed line, or -1 */
+static int parse_line(const char *line)
+{
+    int writer, seq;
+    char expect[LINE_LEN];
+
+    if (sscanf(line, "w%d %d ", &writer, &seq) != 2 ||
+        writer < 0 || writer >= WRITERS || seq < 0 || seq >= LINES)
+        return -1;
+    format_line(expect, writer, seq);
+    if (memcmp(line, expect, LINE_LEN) != 0)
+        return -1;
+    return writer * LINES + seq;
+}
+
+/* Record that id b directly follows id a somewhere in the history */
+static void note_successor(int a, int b)
+{
+    pthread_mutex_lock(&succ_lock);
+    int prev = succ[a];
+    if (prev < 0)
+        succ[a] = b;
+    pthread_mutex_unlock(&succ_lock);
+    if (prev >= 0 && prev != b)
+        fail("w%d/%d followed by both w%d/%d and w%d/%d", a / LINES, a % LINES,
+             prev / LINES, prev % LINES, b / LINES, b % LINES);
+}
+
+/*
+ * -i: rebuild the history from the successor links and check that each
+ * client was sent lines in strictly increasing history order
+ */
+static void check_incremental(void)
+{
+    static int chain[WRITERS * LINES], index[WRITERS * LINES];
+    static bool has_pred[WRITERS * LINES];
+
+    for (int id = 0; id < WRITERS * LINES; id++) {
+        if (succ[id] >= 0)
+            has_pred[succ[id]] = true;
+        chain[id] = -1;
+    }
+    for (int id = 0; id < WRITERS * LINES; id++) {
+        if (has_pred[id])
+            continue;
+        int n = 0;
+        for (int cur = id; cur >= 0 && chain[cur] < 0; cur = succ[cur]) {
+            chain[cur] = id;
+            index[cur] = n++;
+        }
+    }
+
+    for (int w = 0; w < WRITERS; w++) {
+        for (int i = 1; i < received_count[w]; i++) {
+            int a = received[w][i - 1], b = received[w][i];
+            if (chain[a] >= 0 && chain[a] == chain[b] && index[b] <= index[a]) {
+                fail("w%d was sent w%d/%d after w%d/%d, which comes later", w,
+                     b / LINES, b % LINES, a / LINES, a % LINES);
+                break;
+            }
+        }
+    }
+}
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(PORT) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read until the reply ends with the line just sent, or time out */
+static ssize_t read_reply(int fd, char *buf, size_t cap, const char *own)
+{
+    size_t len = 0;
+
+    while (len < LINE_LEN || memcmp(buf + len - LINE_LEN, own, LINE_LEN) != 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (len == cap || poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0)
+            return -1;
+        ssize_t n = recv(fd, buf + len, cap - len, 0);
+        if (n <= 0)
+            return -1;
+        len += n;
+    }
+    return len;
+}
+
+static void *writer_thread(void *arg)
+{
+    int writer = (int)(long)arg;
+    char line[LINE_LEN];
+    char reply[1 << 16];
+    int fd = connect_server();
+
+    if (fd < 0) {
+        fail("w%d: connect: %s", writer, strerror(errno));
+        return NULL;
+    }
+
+    for (int seq = 0; seq < LINES && !failures; seq++) {
+        format_line(line, writer, seq);
+        if (send(fd, line, LINE_LEN, MSG_NOSIGNAL) != LINE_LEN) {
+            fail("w%d: send: %s", writer, strerror(errno));
+            break;
+        }
+        ssize_t len = read_reply(fd, reply, sizeof(reply), line);
+        if (len < 0) {
+            fail("w%d/%d: reply does not end with the line sent", writer, seq);
+            break;
+        }
+        if (len % LINE_LEN) {
+            fail("w%d/%d: reply of %zd bytes is not whole lines", writer, seq, len);
+            break;
+        }
+
+        int prev = -1;
+        for (ssize_t off = 0; off < len; off += LINE_LEN) {
+            int id = parse_line(reply + off);
+            if (id < 0) {
+                fail("w%d/%d: malformed line at offset %zd: %.*s", writer, seq, off,
+                     LINE_LEN - 1, reply + off);
+                break;
+            }
+            if (prev >= 0)
+                note_successor(prev, id);
+            prev = id;
+            if (incremental && received_count[writer] < LINES * WRITERS)
+                received[writer][received_count[writer]++] = id;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s shim.so aesdsocket [options...]\n", argv[0]);
+        return 2;
+    }
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0)
+            incremental = true;
+    }
+    memset(succ, -1, sizeof(succ));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", argv[1], 1);
+        if (!getenv("AESDCHAR_SHIM_DELAY_US"))
+            setenv("AESDCHAR_SHIM_DELAY_US", "200", 1);
+        execv(argv[2], argv + 2);
+        perror(argv[2]);
+        _exit(127);
+    }
+
+    /* Wait for the listener */
+    int fd = -1;
+    for (int i = 0; i < 100 && fd < 0; i++) {
+        fd = connect_server();
+        if (fd < 0)
+            usleep(50000);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "FAIL: server did not start listening\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    close(fd);
+
+    pthread_t tids[WRITERS];
+    for (long i = 0; i < WRITERS; i++)
+        pthread_create(&tids[i], NULL, writer_thread, (void *)i);
+    for (int i = 0; i < WRITERS; i++)
+        pthread_join(tids[i], NULL);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (incremental)
+        check_incremental();
+
+    printf("%s:", failures ? "FAIL" : "PASS");
+    for (int i = 2; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf("\n");
+    return failures ? 1 : 0;
+}